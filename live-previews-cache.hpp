@@ -0,0 +1,119 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "live-previews-pixels.hpp"
+
+namespace wf
+{
+namespace live_previews
+{
+/* A small premultiplied RGBA thumbnail kept on the CPU */
+struct thumbnail_t
+{
+    int width  = 0;
+    int height = 0;
+    std::vector<uint8_t> pixels;
+
+    pixel_view_t view()
+    {
+        return {pixels.data(), size_t(width * 4), width, height};
+    }
+};
+
+/* Thumbnails by view id, evicting the least recently stored or used one
+ * once more than capacity are kept. */
+class thumbnail_cache_t
+{
+  public:
+    void set_capacity(size_t capacity)
+    {
+        this->capacity = capacity;
+        trim();
+    }
+
+    void put(uint64_t id, thumbnail_t thumbnail)
+    {
+        erase(id);
+        order.push_front(id);
+        entries[id] = {std::move(thumbnail), order.begin()};
+        trim();
+    }
+
+    thumbnail_t *get(uint64_t id)
+    {
+        auto it = entries.find(id);
+        if (it == entries.end())
+        {
+            return nullptr;
+        }
+
+        order.splice(order.begin(), order, it->second.position);
+        return &it->second.thumbnail;
+    }
+
+    void erase(uint64_t id)
+    {
+        auto it = entries.find(id);
+        if (it != entries.end())
+        {
+            order.erase(it->second.position);
+            entries.erase(it);
+        }
+    }
+
+    void clear()
+    {
+        entries.clear();
+        order.clear();
+    }
+
+  private:
+    struct entry_t
+    {
+        thumbnail_t thumbnail;
+        std::list<uint64_t>::iterator position;
+    };
+
+    std::unordered_map<uint64_t, entry_t> entries;
+    std::list<uint64_t> order;
+    size_t capacity = 0;
+
+    void trim()
+    {
+        while (order.size() > capacity)
+        {
+            entries.erase(order.back());
+            order.pop_back();
+        }
+    }
+};
+}
+}
@@ -0,0 +1,198 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "live-previews-pixels.hpp"
+
+namespace wf
+{
+namespace live_previews
+{
+inline std::string base64_encode(const std::vector<uint8_t>& data)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3)
+    {
+        uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        out += alphabet[(v >> 6) & 63];
+        out += alphabet[v & 63];
+    }
+
+    if (i < data.size())
+    {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < data.size())
+        {
+            v |= data[i + 1] << 8;
+        }
+
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        out += (i + 1 < data.size()) ? alphabet[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+
+    return out;
+}
+
+namespace detail
+{
+inline void put_u32_be(std::vector<uint8_t>& out, uint32_t v)
+{
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+}
+
+/* Encode straight-alpha RGBA pixels as QOI (https://qoiformat.org) */
+inline std::vector<uint8_t> encode_qoi(const pixel_view_t& image)
+{
+    std::vector<uint8_t> out = {'q', 'o', 'i', 'f'};
+    detail::put_u32_be(out, image.width);
+    detail::put_u32_be(out, image.height);
+    out.push_back(4); /* RGBA */
+    out.push_back(0); /* sRGB with linear alpha */
+
+    uint8_t index[64][4] = {};
+    uint8_t prev[4] = {0, 0, 0, 255};
+    int run = 0;
+    for (int y = 0; y < image.height; y++)
+    {
+        const uint8_t *px = image.row(y);
+        for (int x = 0; x < image.width; x++, px += 4)
+        {
+            if (std::memcmp(px, prev, 4) == 0)
+            {
+                run++;
+                bool last = (y == image.height - 1) && (x == image.width - 1);
+                if ((run == 62) || last)
+                {
+                    out.push_back(0xc0 | (run - 1));
+                    run = 0;
+                }
+
+                continue;
+            }
+
+            if (run > 0)
+            {
+                out.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+
+            int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+            if (std::memcmp(index[hash], px, 4) == 0)
+            {
+                out.push_back(hash);
+            } else if (px[3] == prev[3])
+            {
+                int8_t dr = px[0] - prev[0];
+                int8_t dg = px[1] - prev[1];
+                int8_t db = px[2] - prev[2];
+                int8_t dr_dg = dr - dg;
+                int8_t db_dg = db - dg;
+                if ((dr >= -2) && (dr <= 1) && (dg >= -2) && (dg <= 1) && (db >= -2) && (db <= 1))
+                {
+                    out.push_back(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                } else if ((dg >= -32) && (dg <= 31) && (dr_dg >= -8) && (dr_dg <= 7) &&
+                           (db_dg >= -8) && (db_dg <= 7))
+                {
+                    out.push_back(0x80 | (dg + 32));
+                    out.push_back(((dr_dg + 8) << 4) | (db_dg + 8));
+                } else
+                {
+                    out.insert(out.end(), {0xfe, px[0], px[1], px[2]});
+                }
+            } else
+            {
+                out.insert(out.end(), {0xff, px[0], px[1], px[2], px[3]});
+            }
+
+            std::memcpy(index[hash], px, 4);
+            std::memcpy(prev, px, 4);
+        }
+    }
+
+    out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+    return out;
+}
+
+/* Encode straight-alpha RGBA pixels as an 8-bit RGBA PNG */
+inline std::vector<uint8_t> encode_png(const pixel_view_t& image)
+{
+    std::vector<uint8_t> raw;
+    raw.reserve((image.width * 4 + 1) * image.height);
+    for (int y = 0; y < image.height; y++)
+    {
+        raw.push_back(0); /* no filter */
+        raw.insert(raw.end(), image.row(y), image.row(y) + image.width * 4);
+    }
+
+    uLongf compressed_size = compressBound(raw.size());
+    std::vector<uint8_t> compressed(compressed_size);
+    if (compress2(compressed.data(), &compressed_size, raw.data(), raw.size(), 6) != Z_OK)
+    {
+        return {};
+    }
+
+    compressed.resize(compressed_size);
+
+    std::vector<uint8_t> out = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    auto put_chunk = [&] (const char *type, const std::vector<uint8_t>& data)
+    {
+        detail::put_u32_be(out, data.size());
+        size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        detail::put_u32_be(out, crc32(0, out.data() + start, out.size() - start));
+    };
+
+    std::vector<uint8_t> header;
+    detail::put_u32_be(header, image.width);
+    detail::put_u32_be(header, image.height);
+    header.insert(header.end(), {8, 6, 0, 0, 0}); /* 8 bit RGBA, no interlace */
+
+    put_chunk("IHDR", header);
+    put_chunk("IDAT", compressed);
+    put_chunk("IEND", {});
+    return out;
+}
+}
+}
@@ -0,0 +1,722 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+namespace wf
+{
+namespace live_previews
+{
+/* A CPU-mapped image with 4 bytes per pixel */
+struct pixel_view_t
+{
+    uint8_t *data = nullptr;
+    size_t stride = 0;
+    int width  = 0;
+    int height = 0;
+
+    uint8_t *row(int y) const
+    {
+        return data + y * stride;
+    }
+};
+
+/* Byte order of a pixel in memory. DRM_FORMAT_ABGR8888 is RGBA and
+ * DRM_FORMAT_ARGB8888 is BGRA on little-endian machines. */
+enum class channel_order_t
+{
+    RGBA,
+    BGRA,
+    ARGB,
+    ABGR,
+};
+
+inline const char *channel_layout(channel_order_t order)
+{
+    switch (order)
+    {
+      case channel_order_t::RGBA:
+        return "RGBA";
+
+      case channel_order_t::BGRA:
+        return "BGRA";
+
+      case channel_order_t::ARGB:
+        return "ARGB";
+
+      case channel_order_t::ABGR:
+        return "ABGR";
+    }
+
+    return "RGBA";
+}
+
+/* Area-average src into the top-left dst_width x dst_height pixels of dst.
+ * Channels are averaged independently, so any 32-bit layout works as long
+ * as both images share it. Only dst rows [y0, y1) are written, which lets
+ * callers split the work into bands across threads. */
+inline void downscale_box(const pixel_view_t& src, const pixel_view_t& dst,
+    int dst_width, int dst_height, int y0, int y1)
+{
+    std::vector<int> x_bounds(dst_width + 1);
+    for (int x = 0; x <= dst_width; x++)
+    {
+        x_bounds[x] = int64_t(x) * src.width / dst_width;
+    }
+
+    y1 = std::min(y1, dst_height);
+    for (int y = y0; y < y1; y++)
+    {
+        int sy0 = int64_t(y) * src.height / dst_height;
+        int sy1 = std::max(sy0 + 1, int(int64_t(y + 1) * src.height / dst_height));
+        uint8_t *out = dst.row(y);
+        for (int x = 0; x < dst_width; x++)
+        {
+            int sx0 = x_bounds[x];
+            int sx1 = std::max(sx0 + 1, x_bounds[x + 1]);
+            uint32_t sum[4] = {0, 0, 0, 0};
+            for (int sy = sy0; sy < sy1; sy++)
+            {
+                const uint8_t *in = src.row(sy) + sx0 * 4;
+                for (int sx = sx0; sx < sx1; sx++, in += 4)
+                {
+                    sum[0] += in[0];
+                    sum[1] += in[1];
+                    sum[2] += in[2];
+                    sum[3] += in[3];
+                }
+            }
+
+            uint32_t area = (sx1 - sx0) * (sy1 - sy0);
+            for (int c = 0; c < 4; c++)
+            {
+                out[x * 4 + c] = (sum[c] + area / 2) / area;
+            }
+        }
+    }
+}
+
+namespace detail
+{
+/* Power-of-two reductions run in two steps per output row: F source rows
+ * are summed into 16-bit lanes, then every F adjacent pixels of that sum
+ * are averaged. 8x8 pixels of 255 still fit into 16 bits. */
+struct scalar_isa
+{
+    template<int F>
+    static void sum_rows(const uint8_t *const *rows, int bytes, uint16_t *acc)
+    {
+        for (int i = 0; i < bytes; i++)
+        {
+            uint16_t sum = 0;
+            for (int r = 0; r < F; r++)
+            {
+                sum += rows[r][i];
+            }
+
+            acc[i] = sum;
+        }
+    }
+
+    template<int F, int SHIFT>
+    static void average_columns(const uint16_t *acc, int width, uint8_t *out)
+    {
+        for (int x = 0; x < width; x++, acc += F * 4, out += 4)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                uint32_t sum = 0;
+                for (int k = 0; k < F; k++)
+                {
+                    sum += acc[k * 4 + c];
+                }
+
+                out[c] = (sum + F * F / 2) >> SHIFT;
+            }
+        }
+    }
+
+    /* Pixel conversions take alpha-last input. Output byte i is input byte
+     * Si, after un-premultiplying the color bytes if STRAIGHT is set. */
+    template<int S0, int S1, int S2, int S3, bool STRAIGHT>
+    static void convert_row(uint8_t *px, int width)
+    {
+        for (int x = 0; x < width; x++, px += 4)
+        {
+            uint8_t in[4] = {px[0], px[1], px[2], px[3]};
+            uint32_t a    = in[3];
+            if (STRAIGHT && (a != 0) && (a != 255))
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    in[c] = std::min<uint32_t>(255, (in[c] * 255 + a / 2) / a);
+                }
+            }
+
+            px[0] = in[S0];
+            px[1] = in[S1];
+            px[2] = in[S2];
+            px[3] = in[S3];
+        }
+    }
+};
+
+#if defined(__SSE2__)
+struct sse2_isa
+{
+    template<int F>
+    static void sum_rows(const uint8_t *const *rows, int bytes, uint16_t *acc)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        int i = 0;
+        for (; i + 16 <= bytes; i += 16)
+        {
+            __m128i lo = _mm_setzero_si128();
+            __m128i hi = _mm_setzero_si128();
+            for (int r = 0; r < F; r++)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(rows[r] + i));
+                lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+            }
+
+            _mm_storeu_si128((__m128i*)(acc + i), lo);
+            _mm_storeu_si128((__m128i*)(acc + i + 8), hi);
+        }
+
+        const uint8_t *tail[F];
+        for (int r = 0; r < F; r++)
+        {
+            tail[r] = rows[r] + i;
+        }
+
+        scalar_isa::sum_rows<F>(tail, bytes - i, acc + i);
+    }
+
+    template<int F, int SHIFT>
+    static void average_columns(const uint16_t *acc, int width, uint8_t *out)
+    {
+        const __m128i round = _mm_set1_epi16(F * F / 2);
+        for (int x = 0; x < width; x++, acc += F * 4, out += 4)
+        {
+            /* Two pixels per vector, F / 2 vectors per output pixel */
+            __m128i v = _mm_loadu_si128((const __m128i*)acc);
+            for (int k = 1; k < F / 2; k++)
+            {
+                v = _mm_add_epi16(v, _mm_loadu_si128((const __m128i*)(acc + k * 8)));
+            }
+
+            v = _mm_add_epi16(v, _mm_srli_si128(v, 8));
+            v = _mm_srli_epi16(_mm_add_epi16(v, round), SHIFT);
+            uint32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+            std::memcpy(out, &pixel, 4);
+        }
+    }
+
+    /* Un-premultiply one pixel held as four 32-bit lanes. c * 255 is exact
+     * in a float and the division is correctly rounded, so this matches the
+     * scalar (c * 255 + a / 2) / a. Alpha and fully transparent pixels are
+     * divided by one instead. */
+    static __m128i unpremultiply_pixel(__m128i pixel)
+    {
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 keep_alpha = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+        __m128 v     = _mm_cvtepi32_ps(pixel);
+        __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128 keep  = _mm_or_ps(keep_alpha, _mm_cmpeq_ps(alpha, _mm_setzero_ps()));
+        __m128 num   = _mm_mul_ps(v, _mm_or_ps(_mm_and_ps(keep, one),
+            _mm_andnot_ps(keep, _mm_set1_ps(255.0f))));
+        __m128 den = _mm_or_ps(_mm_and_ps(keep, one), _mm_andnot_ps(keep, alpha));
+        return _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(num, den), _mm_set1_ps(0.5f)));
+    }
+
+    template<int S0, int S1, int S2, int S3, bool STRAIGHT>
+    static void convert_row(uint8_t *px, int width)
+    {
+        constexpr int order = _MM_SHUFFLE(S3, S2, S1, S0);
+        const __m128i zero  = _mm_setzero_si128();
+        int x = 0;
+        for (; x + 4 <= width; x += 4, px += 16)
+        {
+            __m128i v  = _mm_loadu_si128((const __m128i*)px);
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            if (STRAIGHT)
+            {
+                __m128i p0 = _mm_shuffle_epi32(unpremultiply_pixel(_mm_unpacklo_epi16(lo, zero)), order);
+                __m128i p1 = _mm_shuffle_epi32(unpremultiply_pixel(_mm_unpackhi_epi16(lo, zero)), order);
+                __m128i p2 = _mm_shuffle_epi32(unpremultiply_pixel(_mm_unpacklo_epi16(hi, zero)), order);
+                __m128i p3 = _mm_shuffle_epi32(unpremultiply_pixel(_mm_unpackhi_epi16(hi, zero)), order);
+                lo = _mm_packs_epi32(p0, p1);
+                hi = _mm_packs_epi32(p2, p3);
+            } else
+            {
+                lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, order), order);
+                hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, order), order);
+            }
+
+            _mm_storeu_si128((__m128i*)px, _mm_packus_epi16(lo, hi));
+        }
+
+        scalar_isa::convert_row<S0, S1, S2, S3, STRAIGHT>(px, width - x);
+    }
+};
+
+struct avx2_isa
+{
+    template<int F>
+    __attribute__((target("avx2")))
+    static void sum_rows(const uint8_t *const *rows, int bytes, uint16_t *acc)
+    {
+        int i = 0;
+        for (; i + 32 <= bytes; i += 32)
+        {
+            __m256i lo = _mm256_setzero_si256();
+            __m256i hi = _mm256_setzero_si256();
+            for (int r = 0; r < F; r++)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(rows[r] + i));
+                lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+                hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+            }
+
+            _mm256_storeu_si256((__m256i*)(acc + i), lo);
+            _mm256_storeu_si256((__m256i*)(acc + i + 16), hi);
+        }
+
+        const uint8_t *tail[F];
+        for (int r = 0; r < F; r++)
+        {
+            tail[r] = rows[r] + i;
+        }
+
+        scalar_isa::sum_rows<F>(tail, bytes - i, acc + i);
+    }
+
+    template<int F, int SHIFT>
+    static void average_columns(const uint16_t *acc, int width, uint8_t *out)
+    {
+        sse2_isa::average_columns<F, SHIFT>(acc, width, out);
+    }
+
+    template<int S0, int S1, int S2, int S3, bool STRAIGHT>
+    static void convert_row(uint8_t *px, int width)
+    {
+        sse2_isa::convert_row<S0, S1, S2, S3, STRAIGHT>(px, width);
+    }
+};
+#endif
+
+#if defined(__ARM_NEON)
+struct neon_isa
+{
+    template<int F>
+    static void sum_rows(const uint8_t *const *rows, int bytes, uint16_t *acc)
+    {
+        int i = 0;
+        for (; i + 8 <= bytes; i += 8)
+        {
+            uint16x8_t sum = vdupq_n_u16(0);
+            for (int r = 0; r < F; r++)
+            {
+                sum = vaddw_u8(sum, vld1_u8(rows[r] + i));
+            }
+
+            vst1q_u16(acc + i, sum);
+        }
+
+        const uint8_t *tail[F];
+        for (int r = 0; r < F; r++)
+        {
+            tail[r] = rows[r] + i;
+        }
+
+        scalar_isa::sum_rows<F>(tail, bytes - i, acc + i);
+    }
+
+    template<int F, int SHIFT>
+    static void average_columns(const uint16_t *acc, int width, uint8_t *out)
+    {
+        const uint16x4_t round = vdup_n_u16(F * F / 2);
+        for (int x = 0; x < width; x++, acc += F * 4, out += 4)
+        {
+            uint16x8_t v = vld1q_u16(acc);
+            for (int k = 1; k < F / 2; k++)
+            {
+                v = vaddq_u16(v, vld1q_u16(acc + k * 8));
+            }
+
+            uint16x4_t sum = vadd_u16(vget_low_u16(v), vget_high_u16(v));
+            sum = vshr_n_u16(vadd_u16(sum, round), SHIFT);
+            uint8x8_t narrow = vmovn_u16(vcombine_u16(sum, sum));
+            uint32_t pixel   = vget_lane_u32(vreinterpret_u32_u8(narrow), 0);
+            std::memcpy(out, &pixel, 4);
+        }
+    }
+
+  #if defined(__aarch64__)
+    static uint32x4_t unpremultiply_lanes(uint16x4_t color, uint16x4_t alpha)
+    {
+        float32x4_t a   = vcvtq_f32_u32(vmovl_u16(alpha));
+        float32x4_t c   = vcvtq_f32_u32(vmovl_u16(color));
+        uint32x4_t keep = vceqq_f32(a, vdupq_n_f32(0.0f));
+        float32x4_t num = vbslq_f32(keep, c, vmulq_f32(c, vdupq_n_f32(255.0f)));
+        float32x4_t den = vbslq_f32(keep, vdupq_n_f32(1.0f), a);
+        return vcvtq_u32_f32(vaddq_f32(vdivq_f32(num, den), vdupq_n_f32(0.5f)));
+    }
+
+    static uint8x16_t unpremultiply_channel(uint8x16_t color, uint8x16_t alpha)
+    {
+        uint16x8_t c_lo = vmovl_u8(vget_low_u8(color));
+        uint16x8_t c_hi = vmovl_u8(vget_high_u8(color));
+        uint16x8_t a_lo = vmovl_u8(vget_low_u8(alpha));
+        uint16x8_t a_hi = vmovl_u8(vget_high_u8(alpha));
+        uint16x8_t lo   = vcombine_u16(
+            vqmovn_u32(unpremultiply_lanes(vget_low_u16(c_lo), vget_low_u16(a_lo))),
+            vqmovn_u32(unpremultiply_lanes(vget_high_u16(c_lo), vget_high_u16(a_lo))));
+        uint16x8_t hi = vcombine_u16(
+            vqmovn_u32(unpremultiply_lanes(vget_low_u16(c_hi), vget_low_u16(a_hi))),
+            vqmovn_u32(unpremultiply_lanes(vget_high_u16(c_hi), vget_high_u16(a_hi))));
+        return vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi));
+    }
+  #endif
+
+    /* vld4 splits 16 pixels into channel planes, so reordering is just a
+     * matter of which plane is stored where. */
+    template<int S0, int S1, int S2, int S3, bool STRAIGHT>
+    static void convert_row(uint8_t *px, int width)
+    {
+        int x = 0;
+  #if defined(__aarch64__)
+        for (; x + 16 <= width; x += 16, px += 64)
+        {
+            uint8x16x4_t in = vld4q_u8(px);
+            if (STRAIGHT)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    in.val[c] = unpremultiply_channel(in.val[c], in.val[3]);
+                }
+            }
+
+            uint8x16x4_t out;
+            out.val[0] = in.val[S0];
+            out.val[1] = in.val[S1];
+            out.val[2] = in.val[S2];
+            out.val[3] = in.val[S3];
+            vst4q_u8(px, out);
+        }
+
+  #else
+        if (!STRAIGHT)
+        {
+            for (; x + 16 <= width; x += 16, px += 64)
+            {
+                uint8x16x4_t in = vld4q_u8(px);
+                uint8x16x4_t out;
+                out.val[0] = in.val[S0];
+                out.val[1] = in.val[S1];
+                out.val[2] = in.val[S2];
+                out.val[3] = in.val[S3];
+                vst4q_u8(px, out);
+            }
+        }
+
+  #endif
+        scalar_isa::convert_row<S0, S1, S2, S3, STRAIGHT>(px, width - x);
+    }
+};
+#endif
+
+template<class ISA, int F, int SHIFT>
+void downscale_pow2(const pixel_view_t& src, const pixel_view_t& dst,
+    int width, int y0, int y1)
+{
+    std::vector<uint16_t> acc(width * F * 4);
+    const uint8_t *rows[F];
+    for (int y = y0; y < y1; y++)
+    {
+        for (int r = 0; r < F; r++)
+        {
+            rows[r] = src.row(y * F + r);
+        }
+
+        ISA::template sum_rows<F>(rows, width * F * 4, acc.data());
+        ISA::template average_columns<F, SHIFT>(acc.data(), width, dst.row(y));
+    }
+}
+
+using pow2_kernel_t = void (*)(const pixel_view_t&, const pixel_view_t&, int, int, int);
+
+template<class ISA>
+pow2_kernel_t pick_pow2_kernel(int factor)
+{
+    switch (factor)
+    {
+      case 2:
+        return downscale_pow2<ISA, 2, 2>;
+
+      case 4:
+        return downscale_pow2<ISA, 4, 4>;
+
+      case 8:
+        return downscale_pow2<ISA, 8, 6>;
+
+      default:
+        return nullptr;
+    }
+}
+
+inline pow2_kernel_t select_pow2_kernel(int factor)
+{
+#if defined(__SSE2__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2 ? pick_pow2_kernel<avx2_isa>(factor) : pick_pow2_kernel<sse2_isa>(factor);
+#elif defined(__ARM_NEON)
+    return pick_pow2_kernel<neon_isa>(factor);
+#else
+    return pick_pow2_kernel<scalar_isa>(factor);
+#endif
+}
+
+using convert_kernel_t = void (*)(uint8_t*, int);
+
+template<class ISA, bool STRAIGHT>
+convert_kernel_t pick_convert_kernel(int s0, int s1, int s2, int s3)
+{
+    /* Alpha-last input only ever needs one of these four permutations */
+    if ((s0 == 0) && (s1 == 1) && (s2 == 2) && (s3 == 3))
+    {
+        return ISA::template convert_row<0, 1, 2, 3, STRAIGHT>;
+    } else if ((s0 == 2) && (s1 == 1) && (s2 == 0) && (s3 == 3))
+    {
+        return ISA::template convert_row<2, 1, 0, 3, STRAIGHT>;
+    } else if ((s0 == 3) && (s1 == 0) && (s2 == 1) && (s3 == 2))
+    {
+        return ISA::template convert_row<3, 0, 1, 2, STRAIGHT>;
+    } else if ((s0 == 3) && (s1 == 2) && (s2 == 1) && (s3 == 0))
+    {
+        return ISA::template convert_row<3, 2, 1, 0, STRAIGHT>;
+    }
+
+    return nullptr;
+}
+
+template<class ISA>
+convert_kernel_t pick_convert_kernel(bool straight, int s0, int s1, int s2, int s3)
+{
+    return straight ? pick_convert_kernel<ISA, true>(s0, s1, s2, s3) :
+           pick_convert_kernel<ISA, false>(s0, s1, s2, s3);
+}
+
+inline convert_kernel_t select_convert_kernel(bool straight, int s0, int s1, int s2, int s3)
+{
+#if defined(__SSE2__)
+    return pick_convert_kernel<sse2_isa>(straight, s0, s1, s2, s3);
+#elif defined(__ARM_NEON)
+    return pick_convert_kernel<neon_isa>(straight, s0, s1, s2, s3);
+#else
+    return pick_convert_kernel<scalar_isa>(straight, s0, s1, s2, s3);
+#endif
+}
+}
+
+/* Average every factor x factor block of src into one dst pixel, for
+ * factors of 2, 4 and 8. src must hold at least width * factor columns
+ * and y1 * factor rows. Uses the widest SIMD available at runtime and
+ * returns false for unsupported factors, so callers can fall back to
+ * downscale_box(). */
+inline bool downscale_pow2(int factor, const pixel_view_t& src, const pixel_view_t& dst,
+    int width, int y0, int y1)
+{
+    auto kernel = detail::select_pow2_kernel(factor);
+    if (!kernel)
+    {
+        return false;
+    }
+
+    kernel(src, dst, width, y0, y1);
+    return true;
+}
+
+/* Convert rows [y0, y1) of an RGBA or BGRA image in place to the given
+ * byte order, optionally un-premultiplying alpha on the way. Returns false
+ * for input orders that don't keep alpha last. */
+inline bool convert_pixels(const pixel_view_t& image, channel_order_t from, channel_order_t to,
+    bool straight, int y0, int y1)
+{
+    if ((from != channel_order_t::RGBA) && (from != channel_order_t::BGRA))
+    {
+        return false;
+    }
+
+    if ((from == to) && !straight)
+    {
+        return true;
+    }
+
+    const char *in  = channel_layout(from);
+    const char *out = channel_layout(to);
+    int source[4];
+    for (int i = 0; i < 4; i++)
+    {
+        source[i] = std::strchr(in, out[i]) - in;
+    }
+
+    auto kernel = detail::select_convert_kernel(straight, source[0], source[1], source[2], source[3]);
+    if (!kernel)
+    {
+        return false;
+    }
+
+    for (int y = y0; y < std::min(y1, image.height); y++)
+    {
+        kernel(image.row(y), image.width);
+    }
+
+    return true;
+}
+
+/* Hash rows [y0, y1) of image into hashes[y0, y1), eight bytes at a time */
+inline void hash_rows(const pixel_view_t& image, uint64_t *hashes, int y0, int y1)
+{
+    const size_t bytes = image.width * 4;
+    for (int y = y0; y < std::min(y1, image.height); y++)
+    {
+        const uint8_t *px = image.row(y);
+        uint64_t hash = 0xcbf29ce484222325ULL ^ bytes;
+        size_t i = 0;
+        for (; i + 8 <= bytes; i += 8)
+        {
+            uint64_t v;
+            std::memcpy(&v, px + i, 8);
+            hash = (hash ^ v) * 0x100000001b3ULL;
+            hash ^= hash >> 29;
+        }
+
+        for (; i < bytes; i++)
+        {
+            hash = (hash ^ px[i]) * 0x100000001b3ULL;
+        }
+
+        hashes[y] = hash;
+    }
+}
+
+/* Find the vertical shift that best explains cur as a scrolled copy of
+ * prev, such that cur row y equals prev row y + shift. Only rows that are
+ * unique in prev vote, so blank lines don't, and a shift must match at
+ * least an eighth of the rows and beat no shift at all. Returns 0 if
+ * nothing qualifies. */
+inline int find_vertical_shift(const std::vector<uint64_t>& prev, const std::vector<uint64_t>& cur)
+{
+    if (prev.size() != cur.size())
+    {
+        return 0;
+    }
+
+    std::unordered_map<uint64_t, int> rows;
+    for (int y = 0; y < int(prev.size()); y++)
+    {
+        auto [it, inserted] = rows.emplace(prev[y], y);
+        if (!inserted)
+        {
+            it->second = -1;
+        }
+    }
+
+    std::unordered_map<int, int> votes;
+    for (int y = 0; y < int(cur.size()); y++)
+    {
+        auto it = rows.find(cur[y]);
+        if ((it != rows.end()) && (it->second >= 0))
+        {
+            votes[it->second - y]++;
+        }
+    }
+
+    int best = 0;
+    int best_votes = votes[0];
+    for (auto& [shift, count] : votes)
+    {
+        if (count > best_votes)
+        {
+            best = shift;
+            best_votes = count;
+        }
+    }
+
+    if (best_votes < std::max<int>(2, cur.size() / 8))
+    {
+        return 0;
+    }
+
+    return best;
+}
+
+/* Force alpha to 255 in the top-left width pixels of rows [y0, y1), for
+ * content that came from a format without alpha. */
+inline void set_opaque(const pixel_view_t& image, int width, int y0, int y1)
+{
+    for (int y = y0; y < std::min(y1, image.height); y++)
+    {
+        uint8_t *px = image.row(y);
+        for (int x = 0; x < width; x++)
+        {
+            px[x * 4 + 3] = 255;
+        }
+    }
+}
+
+/* Zero everything in dst rows [y0, y1) outside the top-left
+ * width x height rectangle. */
+inline void clear_outside(const pixel_view_t& dst, int width, int height, int y0, int y1)
+{
+    for (int y = y0; y < std::min(y1, dst.height); y++)
+    {
+        if (y >= height)
+        {
+            std::memset(dst.row(y), 0, dst.width * 4);
+        } else if (width < dst.width)
+        {
+            std::memset(dst.row(y) + width * 4, 0, (dst.width - width) * 4);
+        }
+    }
+}
+}
+}
@@ -0,0 +1,259 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <wayfire/nonstd/wlroots-full.hpp>
+#include <wayfire/geometry.hpp>
+
+#include <cstdio>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern "C" {
+#include <wlr/interfaces/wlr_buffer.h>
+#include <drm_fourcc.h>
+}
+
+namespace wf
+{
+namespace live_previews
+{
+/* A wlr_buffer backed by a named POSIX shared memory object, so consumers
+ * can shm_open() and mmap() it by name. The name is unlinked when the
+ * buffer is destroyed; existing consumer mappings stay valid. */
+struct shm_buffer_t
+{
+    wlr_buffer base;
+    char name[64];
+    int fd = -1;
+    void *data = nullptr;
+    size_t size   = 0;
+    size_t stride = 0;
+
+    static shm_buffer_t *from_wlr(wlr_buffer *buffer)
+    {
+        return reinterpret_cast<shm_buffer_t*>(buffer);
+    }
+
+    static void destroy(wlr_buffer *buffer)
+    {
+        auto self = from_wlr(buffer);
+        munmap(self->data, self->size);
+        close(self->fd);
+        shm_unlink(self->name);
+        delete self;
+    }
+
+    static bool begin_data_ptr_access(wlr_buffer *buffer, uint32_t flags, void **data,
+        uint32_t *format, size_t *stride)
+    {
+        auto self = from_wlr(buffer);
+        *data   = self->data;
+        *format = DRM_FORMAT_ABGR8888;
+        *stride = self->stride;
+        return true;
+    }
+
+    static void end_data_ptr_access(wlr_buffer *buffer)
+    {}
+
+    static shm_buffer_t *create(wf::dimensions_t size)
+    {
+        static const wlr_buffer_impl impl = {
+            destroy,
+            nullptr,
+            nullptr,
+            begin_data_ptr_access,
+            end_data_ptr_access,
+        };
+        static uint64_t serial = 0;
+
+        auto self = new shm_buffer_t;
+        std::snprintf(self->name, sizeof(self->name), "/wf-live-previews-%d-%lu",
+            int(getpid()), (unsigned long)serial++);
+        self->stride = size.width * 4;
+        self->size   = self->stride * size.height;
+        self->fd     = shm_open(self->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (self->fd < 0)
+        {
+            delete self;
+            return nullptr;
+        }
+
+        if (ftruncate(self->fd, self->size) < 0)
+        {
+            close(self->fd);
+            shm_unlink(self->name);
+            delete self;
+            return nullptr;
+        }
+
+        self->data = mmap(nullptr, self->size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+        if (self->data == MAP_FAILED)
+        {
+            close(self->fd);
+            shm_unlink(self->name);
+            delete self;
+            return nullptr;
+        }
+
+        wlr_buffer_init(&self->base, &impl, size.width, size.height);
+        return self;
+    }
+};
+
+/* A small ring of shm buffers the preview is rendered into directly.
+ * A buffer handed to the consumer stays held until it is released over
+ * IPC or reclaimed after a timeout, and is never rendered into while
+ * held. Every hold gets its own serial, so a late release of a reclaimed
+ * buffer can't release the frame rendered into it since. */
+class shm_swapchain_t
+{
+  public:
+    static constexpr int SLOTS = 3;
+
+    ~shm_swapchain_t()
+    {
+        for (auto& slot : slots)
+        {
+            drop(slot);
+        }
+    }
+
+    /* Find a buffer the consumer isn't holding, (re)allocated to size.
+     * Returns -1 if all of them are held or allocation failed. */
+    int acquire(wf::dimensions_t size)
+    {
+        for (int i = 0; i < SLOTS; i++)
+        {
+            int index  = (next + i) % SLOTS;
+            auto& slot = slots[index];
+            if (slot.held)
+            {
+                continue;
+            }
+
+            if (slot.buffer &&
+                ((slot.buffer->base.width != size.width) || (slot.buffer->base.height != size.height)))
+            {
+                drop(slot);
+            }
+
+            if (!slot.buffer && !(slot.buffer = shm_buffer_t::create(size)))
+            {
+                return -1;
+            }
+
+            next = (index + 1) % SLOTS;
+            return index;
+        }
+
+        return -1;
+    }
+
+    shm_buffer_t *get(int index)
+    {
+        return slots[index].buffer;
+    }
+
+    /* Mark a buffer as handed to the consumer and return the serial it
+     * has to release it with */
+    uint64_t hold(int index, int64_t now_ms)
+    {
+        slots[index].held = true;
+        slots[index].held_since_ms = now_ms;
+        slots[index].serial = ++last_serial;
+        return last_serial;
+    }
+
+    uint64_t get_serial(int index)
+    {
+        return slots[index].serial;
+    }
+
+    /* Take back buffers a stalled consumer has held for longer than
+     * timeout_ms, so it can't stop the stream for good. Returns the
+     * reclaimed slots, so the consumer can be told to stop reading them. */
+    std::vector<int> reclaim(int64_t now_ms, int timeout_ms)
+    {
+        std::vector<int> reclaimed;
+        for (int i = 0; i < SLOTS; i++)
+        {
+            if (slots[i].held && (now_ms - slots[i].held_since_ms >= timeout_ms))
+            {
+                slots[i].held = false;
+                reclaimed.push_back(i);
+            }
+        }
+
+        return reclaimed;
+    }
+
+    bool release(int index, uint64_t serial)
+    {
+        if ((index < 0) || (index >= SLOTS) || !slots[index].held ||
+            (slots[index].serial != serial))
+        {
+            return false;
+        }
+
+        slots[index].held = false;
+        return true;
+    }
+
+    void release_all()
+    {
+        for (auto& slot : slots)
+        {
+            slot.held = false;
+        }
+    }
+
+  private:
+    struct slot_t
+    {
+        shm_buffer_t *buffer = nullptr;
+        bool held = false;
+        int64_t held_since_ms = 0;
+        uint64_t serial = 0;
+    };
+
+    slot_t slots[SLOTS];
+    int next = 0;
+    uint64_t last_serial = 0;
+
+    void drop(slot_t& slot)
+    {
+        if (slot.buffer)
+        {
+            wlr_buffer_drop(&slot.buffer->base);
+            slot.buffer = nullptr;
+        }
+    }
+};
+}
+}
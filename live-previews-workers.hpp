@@ -0,0 +1,171 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace wf
+{
+namespace live_previews
+{
+/* A small fixed pool of threads for CPU-side pixel work. parallel_for()
+ * splits a range into contiguous chunks, runs one of them on the calling
+ * thread and blocks until all of them are done, so the main loop can use
+ * it like a regular function call before the next output commit. */
+class worker_pool_t
+{
+  public:
+    using range_callback = std::function<void (int begin, int end)>;
+
+    explicit worker_pool_t(int thread_count)
+    {
+        for (int i = 0; i < thread_count; i++)
+        {
+            threads.emplace_back([=] () { worker_main(); });
+        }
+    }
+
+    ~worker_pool_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        work_cv.notify_all();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    int size() const
+    {
+        return threads.size() + 1;
+    }
+
+    void parallel_for(int count, const range_callback& callback)
+    {
+        int chunks = std::min(count, size());
+        if (chunks <= 1)
+        {
+            if (count > 0)
+            {
+                callback(0, count);
+            }
+
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &callback;
+            job_count  = count;
+            job_chunks = chunks;
+            next_chunk = 0;
+            remaining  = chunks;
+            generation++;
+        }
+
+        work_cv.notify_all();
+        run_chunks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [=] { return remaining == 0; });
+        job = nullptr;
+    }
+
+  private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    const range_callback *job = nullptr;
+    int job_count  = 0;
+    int job_chunks = 0;
+    int next_chunk = 0;
+    int remaining  = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    void run_chunks()
+    {
+        while (true)
+        {
+            const range_callback *callback;
+            int chunk, count, chunks;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!job || (next_chunk >= job_chunks))
+                {
+                    return;
+                }
+
+                callback = job;
+                chunk    = next_chunk++;
+                count    = job_count;
+                chunks   = job_chunks;
+            }
+
+            int begin = int64_t(count) * chunk / chunks;
+            int end   = int64_t(count) * (chunk + 1) / chunks;
+            (*callback)(begin, end);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--remaining == 0)
+            {
+                done_cv.notify_one();
+            }
+        }
+    }
+
+    void worker_main()
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [&] { return stopping || (generation != seen); });
+                if (stopping)
+                {
+                    return;
+                }
+
+                seen = generation;
+            }
+
+            run_chunks();
+        }
+    }
+};
+}
+}
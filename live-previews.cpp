@@ -23,16 +23,34 @@
  */
 
 #include <wayfire/plugin.hpp>
+#include <wayfire/seat.hpp>
 #include <wayfire/render-manager.hpp>
 #include <wayfire/view-transform.hpp>
 #include <wayfire/scene-operations.hpp>
 #include <wayfire/signal-definitions.hpp>
+#include <wayfire/toplevel-view.hpp>
+#include <wayfire/workspace-set.hpp>
 #include <wayfire/nonstd/wlroots-full.hpp>
+#include <wayfire/unstable/wlr-surface-node.hpp>
 #include <wayfire/plugins/ipc/ipc-activator.hpp>
 
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <strings.h>
+
+#include "live-previews-cache.hpp"
+#include "live-previews-encode.hpp"
+#include "live-previews-pixels.hpp"
+#include "live-previews-shm.hpp"
+#include "live-previews-workers.hpp"
+
 extern "C" {
 #include <wlr/backend/headless.h>
 #include <wlr/backend/multi.h>
+#include <wlr/render/pixman.h>
 #include <drm_fourcc.h>
 }
 
@@ -40,13 +58,172 @@ namespace wf
 {
 namespace live_previews
 {
+/* Lifecycle of the preview stream. Every exit path goes through
+ * set_stream_state() so buffers are released on the same policy:
+ * REQUESTED -> ACTIVE once the output is set up and hooked,
+ * ACTIVE -> SUSPENDED when the previewed view unmaps,
+ * ACTIVE/SUSPENDED -> RELEASED when the consumer releases the output,
+ * any -> DESTROYED when the output goes away. */
+enum class stream_state_t
+{
+    REQUESTED,
+    ACTIVE,
+    SUSPENDED,
+    RELEASED,
+    DESTROYED,
+};
+
+/* Parse an export byte order. "native" leaves order unset, meaning the
+ * buffer's own layout is kept. Returns false for unknown names. */
+bool parse_channel_order(const std::string& name, std::optional<channel_order_t>& order)
+{
+    order.reset();
+    if (name == "native")
+    {
+        return true;
+    }
+
+    for (auto o : {channel_order_t::RGBA, channel_order_t::BGRA, channel_order_t::ARGB,
+        channel_order_t::ABGR})
+    {
+        if (strcasecmp(name.c_str(), channel_layout(o)) == 0)
+        {
+            order = o;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Maps a wlr_buffer into CPU memory for the lifetime of the object, and
+ * holds a lock on it so a client buffer can't be released back to its
+ * owner mid-read. Only 4-byte-per-pixel formats are accepted. */
+class mapped_buffer_t
+{
+  public:
+    pixel_view_t pixels;
+    uint32_t format = 0;
+    channel_order_t order = channel_order_t::RGBA;
+
+    mapped_buffer_t(wlr_buffer *buffer, uint32_t flags) : buffer(buffer)
+    {
+        void *data;
+        size_t stride;
+        if (!buffer)
+        {
+            return;
+        }
+
+        wlr_buffer_lock(buffer);
+        if (!wlr_buffer_begin_data_ptr_access(buffer, flags, &data, &format, &stride))
+        {
+            return;
+        }
+
+        mapped = true;
+        switch (format)
+        {
+          case DRM_FORMAT_ARGB8888:
+          case DRM_FORMAT_XRGB8888:
+            order = channel_order_t::BGRA;
+          // fallthrough
+
+          case DRM_FORMAT_ABGR8888:
+          case DRM_FORMAT_XBGR8888:
+            pixels = {(uint8_t*)data, stride, buffer->width, buffer->height};
+            break;
+
+          default:
+            break;
+        }
+    }
+
+    mapped_buffer_t(const mapped_buffer_t&) = delete;
+    mapped_buffer_t& operator =(const mapped_buffer_t&) = delete;
+
+    ~mapped_buffer_t()
+    {
+        if (mapped)
+        {
+            wlr_buffer_end_data_ptr_access(buffer);
+        }
+
+        if (buffer)
+        {
+            wlr_buffer_unlock(buffer);
+        }
+    }
+
+    operator bool() const
+    {
+        return pixels.data != nullptr;
+    }
+
+    bool has_alpha() const
+    {
+        return (format == DRM_FORMAT_ABGR8888) || (format == DRM_FORMAT_ARGB8888);
+    }
+
+  private:
+    wlr_buffer *buffer;
+    bool mapped = false;
+};
+
 class live_previews_plugin : public wf::plugin_interface_t
 {
     wf::option_wrapper_t<bool> destroy_output_after_timeout{"live-previews/destroy_output"};
+    wf::option_wrapper_t<bool> hide_output{"live-previews/hide_output"};
+    wf::option_wrapper_t<int> release_buffers_timeout{"live-previews/release_buffers_timeout"};
+    wf::option_wrapper_t<int> buffer_hold_timeout{"live-previews/buffer_hold_timeout"};
+    wf::option_wrapper_t<bool> prewarm_backend{"live-previews/prewarm_backend"};
+    wf::option_wrapper_t<int> backend_idle_timeout{"live-previews/backend_idle_timeout"};
     wf::option_wrapper_t<int> max_dimension{"live-previews/max_dimension"};
     wf::option_wrapper_t<int> frame_skip{"live-previews/frame_skip"};
+    wf::option_wrapper_t<bool> main_surface_only{"live-previews/main_surface_only"};
+    wf::option_wrapper_t<int> subsurface_depth{"live-previews/subsurface_depth"};
+    wf::option_wrapper_t<bool> software_downscale{"live-previews/software_downscale"};
+    wf::option_wrapper_t<int> worker_threads{"live-previews/worker_threads"};
+    wf::option_wrapper_t<bool> direct_downscale{"live-previews/direct_downscale"};
+    wf::option_wrapper_t<bool> cache_layers{"live-previews/cache_layers"};
+    wf::option_wrapper_t<bool> detect_scrolling{"live-previews/detect_scrolling"};
+    wf::option_wrapper_t<bool> defer_to_idle{"live-previews/defer_to_idle"};
+    wf::option_wrapper_t<std::string> pause_plugins{"live-previews/pause_plugins"};
+    wf::option_wrapper_t<int> paused_interval{"live-previews/paused_interval"};
+    wf::option_wrapper_t<int> low_power_size_divisor{"live-previews/low_power_size_divisor"};
+    wf::option_wrapper_t<int> low_power_rate_divisor{"live-previews/low_power_rate_divisor"};
+    wf::option_wrapper_t<int> inline_max_dimension{"live-previews/inline_max_dimension"};
+    wf::option_wrapper_t<bool> capture_on_minimize{"live-previews/capture_on_minimize"};
+    wf::option_wrapper_t<int> thumbnail_cache_size{"live-previews/thumbnail_cache_size"};
+    wf::option_wrapper_t<bool> adaptive_rate{"live-previews/adaptive_rate"};
+    wf::option_wrapper_t<int> adaptive_max_interval{"live-previews/adaptive_max_interval"};
+    wf::option_wrapper_t<int> activity_interval{"live-previews/activity_interval"};
+    wf::option_wrapper_t<bool> prewarm_thumbnails{"live-previews/prewarm_thumbnails"};
+    wf::option_wrapper_t<int> prewarm_delay{"live-previews/prewarm_delay"};
+    wf::option_wrapper_t<int> prewarm_interval{"live-previews/prewarm_interval"};
+    wf::option_wrapper_t<int> prewarm_resize_threshold{"live-previews/prewarm_resize_threshold"};
+    wf::option_wrapper_t<std::string> export_channel_order{"live-previews/export_channel_order"};
+    wf::option_wrapper_t<bool> export_straight_alpha{"live-previews/export_straight_alpha"};
     wf::wl_listener_wrapper on_session_active;
     wf::wl_timer<false> output_destroy_timer;
+    wf::wl_timer<false> output_idle_timer;
+    wf::wl_timer<false> backend_destroy_timer;
+    wf::wl_idle_call backend_idle;
+    wf::wl_timer<false> reconfigure_timer;
+    wf::wl_timer<false> frame_timer;
+    wf::wl_timer<false> held_buffers_timer;
+    wf::wl_timer<false> trailing_frame_timer;
+    wf::wl_timer<true> effect_poll_timer;
+    std::vector<std::string> heavy_plugins;
+    std::vector<wf::output_t*> hooked_outputs;
+    int deferred_frame_timeout_ms;
+    bool frame_pending = false;
+    bool wait_for_physical_frame = false;
+    bool effect_hold = false;
+    int64_t consumer_period_ns = 0;
+    int64_t consumer_phase_ns  = 0;
+    int64_t render_time_ns     = 2000000;
+    bool low_power = false;
     wayfire_view current_preview = nullptr;
     wf::dimensions_t current_size;
     int output_destroy_timeout_ms;
@@ -54,12 +231,55 @@ class live_previews_plugin : public wf::plugin_interface_t
     bool render_flag = false;
     bool hook_set    = false;
     double current_scale;
+    int stream_dimension;
     int drop_frame;
+    int64_t last_frame_ns = 0;
+    bool surface_only = false;
+    int surface_depth = 0;
+    std::optional<channel_order_t> stream_order;
+    bool stream_straight = false;
+    bool stream_shm = false;
+    int requested_dimension = -1;
+    stream_state_t stream_state = stream_state_t::DESTROYED;
+    wf::ipc::client_interface_t *stream_client = nullptr;
+    uint64_t stream_view_id = 0;
 
   private:
     wf::shared_data::ref_ptr_t<wf::ipc::method_repository_t> method_repository;
     std::unique_ptr<wf::scene::render_instance_manager_t> instance_manager = nullptr;
     wlr_backend *headless_backend = NULL;
+    std::unique_ptr<worker_pool_t> workers;
+    std::unique_ptr<shm_swapchain_t> swapchain;
+    wf::auxilliary_buffer_t full_size_buffer;
+    wf::auxilliary_buffer_t snapshot_buffer;
+    thumbnail_cache_t thumbnail_cache;
+    std::map<uint64_t, int64_t> prewarm_due;
+    wf::wl_timer<true> prewarm_timer;
+
+    /* Damage seen on a watched view since the last activity report */
+    struct view_activity_t
+    {
+        std::unique_ptr<wf::scene::render_instance_manager_t> instances;
+        uint64_t damage_events = 0;
+        double damaged_pixels  = 0.0;
+    };
+
+    std::map<uint64_t, std::unique_ptr<view_activity_t>> view_activity;
+    std::map<wf::ipc::client_interface_t*, std::vector<uint64_t>> activity_watchers;
+    wf::wl_timer<true> activity_timer;
+    int64_t activity_last_report = 0;
+    wf::auxilliary_buffer_t layer_cache;
+    wf::region_t layer_damage;
+    wf::geometry_t layer_bbox;
+    double layer_scale = 0.0;
+    bool layer_valid   = false;
+    wf::auxilliary_buffer_t layer_scratch;
+    std::vector<uint64_t> row_hashes;
+    double scroll_residual = 0.0;
+    bool serve_thumbnail     = false;
+    uint64_t last_frame_hash = 0;
+    int frame_backoff_ms     = 0;
+    wf::wl_timer<false> scroll_settle_timer;
 
     scene::damage_callback push_damage = [=] (wf::region_t region)
     {
@@ -68,269 +288,2351 @@ class live_previews_plugin : public wf::plugin_interface_t
             return;
         }
 
-        /* XXX: Any damage on the preview output will schedule a repaint
-         * which calls our post_hook, so we ignore the damage region arg
-         * and damage as little as possible. */
+        if (cache_layers)
+        {
+            layer_damage |= region;
+        }
 
-        wo->render->damage({0, 0, 1, 1}, true);
         render_flag = true;
+        schedule_preview_frame();
     };
 
-    void destroy_render_instance_manager()
+    /* Repaints of the preview output are requested through here, and at
+     * most one is outstanding. Depending on the stream it is flushed when
+     * a full-screen effect ends, at the consumer's deadline, after the next
+     * physical output commit, or right away. */
+    void schedule_preview_frame()
     {
-        if (!instance_manager)
+        if (frame_pending)
         {
             return;
         }
 
-        instance_manager.reset();
-        instance_manager = nullptr;
+        frame_pending = true;
+        if (heavy_effect_active())
+        {
+            hold_for_effect();
+        } else if (frame_backoff_ms > 0)
+        {
+            frame_timer.set_timeout(frame_backoff_ms, [=] ()
+            {
+                flush_preview_frame();
+            });
+        } else if (consumer_period_ns > 0)
+        {
+            frame_timer.set_timeout(time_to_consumer_deadline_ms(), [=] ()
+            {
+                flush_preview_frame();
+            });
+        } else if (defer_to_idle)
+        {
+            /* Hold the repaint until one of the physical outputs has
+             * committed its frame, so preview rendering runs in the slack
+             * before the next vblank instead of competing with it. The
+             * timer covers the case where no physical output repaints. */
+            wait_for_physical_frame = true;
+            frame_timer.set_timeout(deferred_frame_timeout_ms, [=] ()
+            {
+                flush_preview_frame();
+            });
+        } else
+        {
+            flush_preview_frame();
+        }
     }
 
-    void create_render_instance_manager(wayfire_view view)
+    void cancel_preview_frame()
     {
-        if (instance_manager)
+        frame_pending = false;
+        wait_for_physical_frame = false;
+        frame_timer.disconnect();
+        if (effect_hold)
         {
-            return;
+            effect_hold = false;
+            effect_poll_timer.disconnect();
         }
-
-        std::vector<scene::node_ptr> nodes;
-        nodes.push_back(view->get_root_node());
-        instance_manager = std::make_unique<wf::scene::render_instance_manager_t>(nodes, push_damage,
-            view->get_output());
-        instance_manager->set_visibility_region(view->get_surface_root_node()->get_bounding_box());
     }
 
-  public:
+    void flush_preview_frame()
+    {
+        cancel_preview_frame();
+        damage_preview_output();
+    }
 
-    void init() override
+    void damage_preview_output()
     {
-        method_repository->register_method("live_previews/request_stream", request_stream);
-        method_repository->register_method("live_previews/release_output", release_output);
-        on_session_active.set_callback([=] (void*)
-        {
-            if (!wf::get_core().session->active)
-            {
-                destroy_output();
-            }
-        });
-        if (wf::get_core().session)
+        if (!wo)
         {
-            on_session_active.connect(&wf::get_core().session->events.active);
+            return;
         }
 
-        output_destroy_timeout_ms = 5000;
+        /* XXX: Any damage on the preview output will schedule a repaint
+         * which calls our post_hook, so we ignore the damage region arg
+         * and damage as little as possible. */
+
+        wo->render->damage({0, 0, 1, 1}, true);
     }
 
-    wf::ipc::method_callback request_stream = [=] (wf::json_t data)
+    /* Full-screen effects like scale, expo or cube keep the main thread busy
+     * and hide the preview's source anyway, so previews are held (or
+     * throttled to paused_interval) while one of pause_plugins is active on
+     * any physical output. */
+    bool heavy_effect_active()
     {
-        auto id = wf::ipc::json_get_uint64(data, "id");
-        if (auto view = wf::ipc::find_view_by_id(id))
+        for (auto output : wf::get_core().output_layout->get_outputs())
         {
-            output_destroy_timer.disconnect();
-            auto vg = view->get_surface_root_node()->get_bounding_box();
-            if (vg.width < vg.height)
+            if (output == wo)
             {
-                current_scale = max_dimension / double(vg.height);
-                vg.width  = vg.width * current_scale;
-                vg.height = max_dimension;
-            } else
-            {
-                current_scale = max_dimension / double(vg.width);
-                vg.height     = vg.height * current_scale;
-                vg.width = max_dimension;
-            }
-
-            auto size = wf::dimensions_t{vg.width, vg.height};
-
-            drop_frame = int(frame_skip);
-
-            if (size != current_size)
-            {
-                current_size.width  = size.width;
-                current_size.height = size.height;
-                if (wo)
-                {
-                    wlr_output_state state;
-                    wlr_output_state_init(&state);
-                    wlr_output_state_set_custom_mode(&state, size.width, size.height, 0);
-                    if (wlr_output_test_state(wo->handle, &state))
-                    {
-                        wlr_output_commit_state(wo->handle, &state);
-                    } else
-                    {
-                        destroy_output();
-                    }
-                }
+                continue;
             }
 
-            if (wo)
+            for (auto& name : heavy_plugins)
             {
-                if (!hook_set)
+                if (output->is_plugin_active(name))
                 {
-                    wo->render->add_post(&post_hook);
-                    hook_set = true;
+                    return true;
                 }
-
-                view->connect(&view_unmapped);
-                destroy_render_instance_manager();
-                create_render_instance_manager(view);
-                view->get_output()->render->damage_whole();
-                wo->render->damage_whole();
-                current_preview = view;
-                view->damage();
-                return wf::ipc::json_ok();
-            }
-
-            if (!headless_backend)
-            {
-                headless_backend = wlr_headless_backend_create(wf::get_core().ev_loop);
-                wlr_multi_backend_add(wf::get_core().backend, headless_backend);
-                wlr_backend_start(headless_backend);
             }
+        }
 
-            auto handle = wlr_headless_add_output(headless_backend, size.width, size.height);
-            wlr_output_state state;
-            wlr_output_state_init(&state);
-            wlr_output_state_set_render_format(&state, DRM_FORMAT_ABGR8888);
-            if (wlr_output_test_state(handle, &state))
-            {
-                wlr_output_commit_state(handle, &state);
-            }
+        return false;
+    }
 
-            auto global = handle->global;
-            handle->global = NULL;
-            wlr_output_set_name(handle, "live-preview");
-            wlr_output_set_description(handle, "Live Window Previews Virtual Output");
-            handle->global = global;
-            wo = wf::get_core().output_layout->find_output(handle);
-            if (!hook_set)
+    void hold_for_effect()
+    {
+        effect_hold = true;
+        effect_poll_timer.set_timeout((paused_interval > 0) ? int(paused_interval) : 100, [=] ()
+        {
+            if (heavy_effect_active() && (paused_interval <= 0))
             {
-                wo->render->add_post(&post_hook);
-                hook_set = true;
+                return true;
             }
 
-            view->connect(&view_unmapped);
-            destroy_render_instance_manager();
-            create_render_instance_manager(view);
-            view->get_output()->render->damage_whole();
-            wo->render->damage_whole();
-            current_preview = view;
-            view->damage();
+            /* The effect ended, or it is time for a throttled update */
+            effect_hold   = false;
+            frame_pending = false;
+            damage_preview_output();
+            return false;
+        });
+    }
 
-            return wf::ipc::json_ok();
+    std::function<void()> on_pause_plugins_changed = [=] ()
+    {
+        heavy_plugins.clear();
+        std::istringstream names{std::string(pause_plugins)};
+        std::string name;
+        while (names >> name)
+        {
+            heavy_plugins.push_back(name);
         }
-
-        return wf::ipc::json_error("no such view");
     };
 
-    wf::ipc::method_callback release_output = [=] (wf::json_t data)
+    static int64_t monotonic_ns()
     {
-        destroy_render_instance_manager();
-        view_unmapped.disconnect();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-        if (hook_set)
+    /* Consumers that display the preview at their own refresh rate pass
+     * their refresh period and the CLOCK_MONOTONIC time of one of their
+     * vblanks. Renders are then started so they finish just before the
+     * consumer's next vblank, at most once per consumer frame. */
+    int time_to_consumer_deadline_ms()
+    {
+        const int64_t margin_ns = 1000000;
+        int64_t now  = monotonic_ns();
+        int64_t lead = render_time_ns + margin_ns;
+
+        int64_t since_phase = now + lead - consumer_phase_ns;
+        int64_t periods     = since_phase / consumer_period_ns;
+        if ((since_phase >= 0) && (since_phase % consumer_period_ns))
         {
-            wo->render->rem_post(&post_hook);
-            hook_set = false;
+            periods++;
         }
 
-        output_destroy_timer.disconnect();
-        if (destroy_output_after_timeout)
+        int64_t vblank = consumer_phase_ns + periods * consumer_period_ns;
+        return std::max<int64_t>(1, (vblank - lead - now) / 1000000);
+    }
+
+    wf::effect_hook_t on_physical_frame = [=] ()
+    {
+        if (wait_for_physical_frame)
         {
-            output_destroy_timer.set_timeout(output_destroy_timeout_ms, [=] ()
-            {
-                destroy_output();
-            });
+            flush_preview_frame();
         }
-
-        return wf::ipc::json_ok();
     };
 
-    void take_snapshot(wf::render_target_t *target)
+    void hook_physical_output(wf::output_t *output)
     {
-        auto root_node = current_preview->get_surface_root_node();
-        const wf::geometry_t bbox = root_node->get_bounding_box();
-
-        current_scale = (bbox.width < bbox.height) ?
-            (max_dimension / double(bbox.height)) :
-            (max_dimension / double(bbox.width));
+        if ((output == wo) ||
+            (std::find(hooked_outputs.begin(), hooked_outputs.end(), output) != hooked_outputs.end()))
+        {
+            return;
+        }
 
-        target->geometry = bbox;
-        target->scale    = current_scale;
+        output->render->add_effect(&on_physical_frame, wf::OUTPUT_EFFECT_POST);
+        hooked_outputs.push_back(output);
+    }
 
-        std::vector<scene::render_instance_uptr> instances;
-        root_node->gen_render_instances(instances, [] (auto) {}, current_preview->get_output());
+    void unhook_physical_outputs()
+    {
+        for (auto output : hooked_outputs)
+        {
+            output->render->rem_effect(&on_physical_frame);
+        }
 
-        render_pass_params_t params;
-        params.background_color = {0, 0, 0, 0};
-        params.damage    = bbox;
-        params.target    = *target;
-        params.instances = &instances;
-        params.flags     = RPASS_CLEAR_BACKGROUND;
-        render_pass_t::run(params);
+        hooked_outputs.clear();
     }
 
-    wf::post_hook_t post_hook = [=] (wf::auxilliary_buffer_t& src, const wf::render_buffer_t& dst)
+    wf::signal::connection_t<wf::output_added_signal> on_output_added = [=] (wf::output_added_signal *ev)
     {
-        if (drop_frame++ >= int(frame_skip))
+        ev->output->connect(&on_minimize_request);
+        if ((stream_state == stream_state_t::ACTIVE) && defer_to_idle)
         {
-            drop_frame = 0;
-        } else
+            hook_physical_output(ev->output);
+        }
+    };
+
+    wf::signal::connection_t<wf::output_pre_remove_signal> on_output_pre_remove =
+        [=] (wf::output_pre_remove_signal *ev)
+    {
+        auto it = std::find(hooked_outputs.begin(), hooked_outputs.end(), ev->output);
+        if (it != hooked_outputs.end())
         {
-            return;
+            ev->output->render->rem_effect(&on_physical_frame);
+            hooked_outputs.erase(it);
         }
+    };
 
-        if (!current_preview)
+    void destroy_render_instance_manager()
+    {
+        if (!instance_manager)
         {
             return;
         }
 
-        if (!render_flag)
+        instance_manager.reset();
+        instance_manager = nullptr;
+    }
+
+    void create_render_instance_manager(wayfire_view view)
+    {
+        if (instance_manager)
         {
             return;
         }
 
-        render_flag = false;
+        std::vector<scene::node_ptr> nodes;
+        wf::geometry_t visible = view->get_surface_root_node()->get_bounding_box();
+        auto surface_node = surface_only ?
+            find_surface_node(view->get_surface_root_node(), view->get_wlr_surface()) : nullptr;
+        if (surface_node && (surface_depth == 0))
+        {
+            /* Popups, decorations and subsurfaces don't wake us up */
+            nodes.push_back(surface_node);
+            visible = surface_node->get_bounding_box();
+        } else
+        {
+            nodes.push_back(view->get_root_node());
+        }
 
-        wf::render_target_t target = wf::render_target_t(dst);
-        this->take_snapshot(&target);
+        instance_manager = std::make_unique<wf::scene::render_instance_manager_t>(nodes, push_damage,
+            view->get_output());
+        instance_manager->set_visibility_region(visible);
+    }
+
+    struct preview_surface_t
+    {
+        wlr_surface *surface;
+        wf::point_t offset;
     };
 
-    wf::signal::connection_t<wf::view_unmapped_signal> view_unmapped = [=] (wf::view_unmapped_signal *ev)
+    scene::node_ptr find_surface_node(const scene::node_ptr& root, wlr_surface *surface)
     {
-        if (!current_preview || (ev->view != current_preview))
+        if (!surface)
         {
-            return;
+            return nullptr;
         }
 
-        view_unmapped.disconnect();
+        auto surface_node = dynamic_cast<scene::wlr_surface_node_t*>(root.get());
+        if (surface_node && (surface_node->get_surface() == surface))
+        {
+            return root;
+        }
 
-        destroy_render_instance_manager();
-        current_preview = nullptr;
-        if (hook_set)
+        for (auto& child : root->get_children())
         {
-            wo->render->rem_post(&post_hook);
-            hook_set = false;
+            if (auto node = find_surface_node(child, surface))
+            {
+                return node;
+            }
         }
-    };
 
-    void destroy_output()
+        return nullptr;
+    }
+
+    /* Collect the surface and its mapped subsurfaces up to depth levels deep,
+     * in stacking order, with offsets relative to the main surface. */
+    void collect_surfaces(wlr_surface *surface, wf::point_t offset, int depth,
+        std::vector<preview_surface_t>& surfaces)
     {
-        auto output = wf::get_core().output_layout->find_output("live-preview");
-        output_destroy_timer.disconnect();
-        if (!output)
+        wlr_subsurface *subsurface;
+        if (depth > 0)
         {
-            return;
+            wl_list_for_each(subsurface, &surface->current.subsurfaces_below, current.link)
+            {
+                if (subsurface->surface->mapped)
+                {
+                    collect_surfaces(subsurface->surface,
+                        {offset.x + subsurface->current.x, offset.y + subsurface->current.y},
+                        depth - 1, surfaces);
+                }
+            }
         }
 
-        destroy_render_instance_manager();
-        current_preview = nullptr;
-        view_unmapped.disconnect();
-        if (hook_set)
+        surfaces.push_back({surface, offset});
+
+        if (depth > 0)
         {
-            output->render->rem_post(&post_hook);
-            hook_set = false;
+            wl_list_for_each(subsurface, &surface->current.subsurfaces_above, current.link)
+            {
+                if (subsurface->surface->mapped)
+                {
+                    collect_surfaces(subsurface->surface,
+                        {offset.x + subsurface->current.x, offset.y + subsurface->current.y},
+                        depth - 1, surfaces);
+                }
+            }
+        }
+    }
+
+    wf::geometry_t get_preview_bbox(wayfire_view view, bool main_only)
+    {
+        auto surface = view->get_wlr_surface();
+        if (main_only && surface)
+        {
+            return {0, 0, surface->current.width, surface->current.height};
+        }
+
+        return view->get_surface_root_node()->get_bounding_box();
+    }
+
+    wf::geometry_t get_preview_bbox(wayfire_view view)
+    {
+        return get_preview_bbox(view, surface_only);
+    }
+
+    /* Fit the preview into a stream_dimension sized square */
+    wf::dimensions_t get_preview_size(wf::geometry_t vg)
+    {
+        if (vg.width < vg.height)
+        {
+            current_scale = stream_dimension / double(vg.height);
+            vg.width  = vg.width * current_scale;
+            vg.height = stream_dimension;
+        } else
+        {
+            current_scale = stream_dimension / double(vg.width);
+            vg.height     = vg.height * current_scale;
+            vg.width = stream_dimension;
+        }
+
+        return {vg.width, vg.height};
+    }
+
+    /* Low power mode divides the preview size and rate, and skips the more
+     * expensive software filtering. */
+    int get_max_dimension()
+    {
+        int dimension = (requested_dimension > 0) ? requested_dimension : int(max_dimension);
+        if (!low_power)
+        {
+            return dimension;
+        }
+
+        return std::max(1, dimension / std::max(1, int(low_power_size_divisor)));
+    }
+
+    /* A requested max_dimension of 0 means native size: the preview is
+     * rendered 1:1. */
+    bool is_native_stream()
+    {
+        return requested_dimension == 0;
+    }
+
+    int get_stream_dimension(wayfire_view view)
+    {
+        if (is_native_stream())
+        {
+            auto bbox = get_preview_bbox(view);
+            return std::max({1, bbox.width, bbox.height});
+        }
+
+        return get_max_dimension();
+    }
+
+    /* Low power mode throttles by time instead, see throttle_low_power() */
+    int get_frame_skip()
+    {
+        return low_power ? 0 : int(frame_skip);
+    }
+
+    /* The interval frame_skip and low_power_rate_divisor together would
+     * give at the preview output's refresh rate */
+    int64_t get_low_power_interval_ns()
+    {
+        int refresh_mhz = (wo && (wo->handle->refresh > 0)) ? wo->handle->refresh : 60000;
+        return int64_t(1000000000000) / refresh_mhz *
+               (std::max(0, int(frame_skip)) + 1) * std::max(1, int(low_power_rate_divisor));
+    }
+
+    /* Skipping repaints would leave the preview stale whenever the view
+     * stops changing on a skipped one, so low power mode keeps a minimum
+     * interval between frames and arms a timer for the trailing frame
+     * instead. Returns true if the frame must wait. */
+    bool throttle_low_power()
+    {
+        if (!low_power)
+        {
+            return false;
+        }
+
+        int64_t wait_ns = last_frame_ns + get_low_power_interval_ns() - monotonic_ns();
+        if (wait_ns <= 0)
+        {
+            return false;
+        }
+
+        trailing_frame_timer.set_timeout((wait_ns + 999999) / 1000000, [=] ()
+        {
+            damage_preview_output();
+        });
+        return true;
+    }
+
+    wf::ipc::method_callback set_power_mode = [=] (wf::json_t data)
+    {
+        auto mode = wf::ipc::json_get_string(data, "mode");
+        if ((mode != "low") && (mode != "normal"))
+        {
+            return wf::ipc::json_error("mode must be \"low\" or \"normal\"");
+        }
+
+        bool enable = (mode == "low");
+        if (enable != low_power)
+        {
+            low_power = enable;
+            reconfigure_timer.disconnect();
+            reconfigure_stream();
+        }
+
+        auto response = wf::ipc::json_ok();
+        response["mode"] = mode;
+        return response;
+    };
+
+    /* Option changes are coalesced, so a burst of edits from a settings
+     * tool results in a single output mode change. */
+    std::function<void()> on_stream_option_changed = [=] ()
+    {
+        reconfigure_timer.disconnect();
+        reconfigure_timer.set_timeout(100, [=] ()
+        {
+            reconfigure_stream();
+        });
+    };
+
+    void reconfigure_stream()
+    {
+        drop_frame = get_frame_skip();
+        if ((stream_state != stream_state_t::ACTIVE) || !current_preview)
+        {
+            return;
+        }
+
+        int previous_dimension = stream_dimension;
+        stream_dimension = get_stream_dimension(current_preview);
+        auto size = get_preview_size(get_preview_bbox(current_preview));
+        if ((size != current_size) && !fit_output(size))
+        {
+            stream_dimension = previous_dimension;
+            return;
+        }
+
+        current_size = size;
+
+        invalidate_layer_cache();
+        render_flag = true;
+        wo->render->damage_whole();
+    }
+
+  public:
+
+    void init() override
+    {
+        max_dimension.set_callback(on_stream_option_changed);
+        frame_skip.set_callback(on_stream_option_changed);
+        pause_plugins.set_callback(on_pause_plugins_changed);
+        on_pause_plugins_changed();
+        thumbnail_cache_size.set_callback([=] ()
+        {
+            thumbnail_cache.set_capacity(std::max(0, int(thumbnail_cache_size)));
+        });
+        thumbnail_cache.set_capacity(std::max(0, int(thumbnail_cache_size)));
+        method_repository->register_method("live_previews/request_stream", request_stream);
+        method_repository->register_method("live_previews/release_output", release_output);
+        method_repository->register_method("live_previews/set_power_mode", set_power_mode);
+        method_repository->register_method("live_previews/snapshot", snapshot);
+        method_repository->register_method("live_previews/workspace_snapshot", workspace_snapshot);
+        method_repository->register_method("live_previews/release_buffer", release_buffer);
+        method_repository->register_method("live_previews/watch_activity", watch_activity);
+        on_session_active.set_callback([=] (void*)
+        {
+            if (!wf::get_core().session->active)
+            {
+                destroy_output("session-inactive");
+            }
+        });
+        method_repository->connect(&on_client_disconnected);
+        wf::get_core().output_layout->connect(&on_layout_changed);
+        wf::get_core().output_layout->connect(&on_output_added);
+        wf::get_core().output_layout->connect(&on_output_pre_remove);
+        wf::get_core().connect(&on_view_unmapped);
+        wf::get_core().connect(&on_view_mapped);
+        for (auto output : wf::get_core().output_layout->get_outputs())
+        {
+            output->connect(&on_minimize_request);
+        }
+        if (wf::get_core().session)
+        {
+            on_session_active.connect(&wf::get_core().session->events.active);
+        }
+
+        output_destroy_timeout_ms = 5000;
+        deferred_frame_timeout_ms = 16;
+
+        if (prewarm_backend)
+        {
+            if (wf::get_core().get_current_state() == wf::compositor_state_t::RUNNING)
+            {
+                schedule_backend_prewarm();
+            } else
+            {
+                wf::get_core().connect(&on_startup_finished);
+            }
+        }
+    }
+
+    wf::signal::connection_t<wf::core_startup_finished_signal> on_startup_finished =
+        [=] (wf::core_startup_finished_signal *ev)
+    {
+        schedule_backend_prewarm();
+    };
+
+    /* Create the headless backend once the compositor is idle after startup,
+     * so the first hover doesn't pay for it. */
+    void schedule_backend_prewarm()
+    {
+        backend_idle.run_once([=] ()
+        {
+            if (headless_backend)
+            {
+                return;
+            }
+
+            create_headless_backend();
+            arm_backend_teardown();
+        });
+    }
+
+    void create_headless_backend()
+    {
+        backend_destroy_timer.disconnect();
+        if (headless_backend)
+        {
+            return;
+        }
+
+        headless_backend = wlr_headless_backend_create(wf::get_core().ev_loop);
+        wlr_multi_backend_add(wf::get_core().backend, headless_backend);
+        wlr_backend_start(headless_backend);
+    }
+
+    /* Tear the backend down after backend_idle_timeout without a stream.
+     * An idle output that was kept around is destroyed along with it. */
+    void arm_backend_teardown()
+    {
+        backend_destroy_timer.disconnect();
+        if (backend_idle_timeout <= 0)
+        {
+            return;
+        }
+
+        backend_destroy_timer.set_timeout(backend_idle_timeout * 1000, [=] ()
+        {
+            if (!headless_backend || (stream_state == stream_state_t::REQUESTED) ||
+                (stream_state == stream_state_t::ACTIVE))
+            {
+                return;
+            }
+
+            /* Destroying the output re-arms this timer, so leave the
+             * callback first */
+            backend_idle.run_once([=] ()
+            {
+                destroy_output("idle");
+                destroy_headless_backend();
+            });
+        });
+    }
+
+    void destroy_headless_backend()
+    {
+        backend_destroy_timer.disconnect();
+        if (!headless_backend)
+        {
+            return;
+        }
+
+        wlr_multi_backend_remove(wf::get_core().backend, headless_backend);
+        wlr_backend_destroy(headless_backend);
+        headless_backend = NULL;
+    }
+
+    wf::ipc::method_callback_full request_stream = [=] (wf::json_t data, wf::ipc::client_interface_t *client)
+    {
+        auto id = wf::ipc::json_get_uint64(data, "id");
+        if (auto view = wf::ipc::find_view_by_id(id))
+        {
+            /* Parse into locals so a rejected request leaves the running
+             * stream untouched */
+            std::optional<channel_order_t> order;
+            if (!parse_channel_order(wf::ipc::json_get_optional_string(data, "channel_order")
+                .value_or(std::string(export_channel_order)), order))
+            {
+                return wf::ipc::json_error("channel_order must be one of native, rgba, bgra, argb or abgr");
+            }
+
+            bool straight = wf::ipc::json_get_optional_bool(data, "straight_alpha").value_or(
+                bool(export_straight_alpha));
+            int depth = wf::ipc::json_get_optional_int64(data, "subsurface_depth").value_or(
+                int(subsurface_depth));
+            if (depth < 0)
+            {
+                return wf::ipc::json_error("subsurface_depth must not be negative");
+            }
+
+            stream_shm = wf::ipc::json_get_optional_bool(data, "shm_buffers").value_or(false) &&
+                wlr_renderer_is_pixman(wf::get_core().renderer);
+            if (stream_client != client)
+            {
+                send_stream_ended("replaced");
+            }
+
+            stream_client = nullptr;
+            set_stream_state(stream_state_t::REQUESTED);
+            surface_only = wf::ipc::json_get_optional_bool(data, "main_surface_only").value_or(
+                bool(main_surface_only));
+            surface_depth   = depth;
+            stream_order    = order;
+            stream_straight = straight;
+            consumer_period_ns = std::max<int64_t>(0,
+                wf::ipc::json_get_optional_int64(data, "refresh_period_ns").value_or(0));
+            consumer_phase_ns = wf::ipc::json_get_optional_int64(data, "phase_ns").value_or(0);
+            requested_dimension = wf::ipc::json_get_optional_int64(data, "max_dimension").value_or(-1);
+            stream_dimension    = get_stream_dimension(view);
+            auto size = get_preview_size(get_preview_bbox(view));
+
+            drop_frame = get_frame_skip();
+
+            current_size = size;
+            if (wo && !fit_output(size))
+            {
+                destroy_output();
+            }
+
+            if (wo)
+            {
+                start_stream(view, client);
+                return stream_reply();
+            }
+
+            create_headless_backend();
+            auto output_size = get_output_size(size);
+            auto handle = wlr_headless_add_output(headless_backend, output_size.width, output_size.height);
+            wlr_output_state state;
+            wlr_output_state_init(&state);
+            wlr_output_state_set_render_format(&state, DRM_FORMAT_ABGR8888);
+            if (wlr_output_test_state(handle, &state))
+            {
+                wlr_output_commit_state(handle, &state);
+            }
+
+            auto global = handle->global;
+            handle->global = NULL;
+            wlr_output_set_name(handle, "live-preview");
+            wlr_output_set_description(handle, "Live Window Previews Virtual Output");
+            handle->global = global;
+            wo = wf::get_core().output_layout->find_output(handle);
+            hide_preview_output();
+            start_stream(view, client);
+
+            return stream_reply();
+        }
+
+        return wf::ipc::json_error("no such view");
+    };
+
+    /* shm_buffers is only honored with the software renderer, so tell the
+     * consumer whether to wait for frame_ready events or capture the output,
+     * and which pixel layout it will actually get. Layout conversion only
+     * applies to shm frames; the output itself is always premultiplied
+     * ABGR8888, which is R, G, B, A in memory. */
+    wf::json_t stream_reply()
+    {
+        auto response = wf::ipc::json_ok();
+        response["shm_buffers"]    = stream_shm;
+        response["channel_order"]  = channel_layout(stream_shm ?
+            stream_order.value_or(channel_order_t::RGBA) : channel_order_t::RGBA);
+        response["straight_alpha"] = stream_shm && stream_straight;
+        return response;
+    }
+
+    /* In shm mode every rendered frame is announced with the name of the
+     * shm object it lives in. The consumer maps it read-only and hands it
+     * back with live_previews/release_buffer, passing both buffer and
+     * serial, once it is done reading. */
+    void send_frame_ready(int index)
+    {
+        auto buffer = swapchain->get(index);
+        wf::json_t event;
+        event["event"]  = "live_previews/frame_ready";
+        event["id"]     = stream_view_id;
+        event["buffer"] = index;
+        event["serial"] = swapchain->get_serial(index);
+        event["name"]   = std::string(buffer->name);
+        event["width"]  = buffer->base.width;
+        event["height"] = buffer->base.height;
+        event["stride"] = (uint64_t)buffer->stride;
+        event["channel_order"]  = channel_layout(stream_order.value_or(channel_order_t::RGBA));
+        event["straight_alpha"] = stream_straight;
+        stream_client->send_json(event);
+    }
+
+    /* A buffer held past buffer_hold_timeout is about to be rendered into
+     * again, so the consumer must stop reading it */
+    void send_buffer_reclaimed(int index)
+    {
+        wf::json_t event;
+        event["event"]  = "live_previews/buffer_reclaimed";
+        event["id"]     = stream_view_id;
+        event["buffer"] = index;
+        event["serial"] = swapchain->get_serial(index);
+        stream_client->send_json(event);
+    }
+
+    /* Releases that don't match the buffer's current hold, such as late
+     * ones for a reclaimed buffer, are refused */
+    wf::ipc::method_callback release_buffer = [=] (wf::json_t data)
+    {
+        auto index  = wf::ipc::json_get_int64(data, "buffer");
+        auto serial = wf::ipc::json_get_uint64(data, "serial");
+        if (!swapchain || !swapchain->release(index, serial))
+        {
+            return wf::ipc::json_error("no such buffer");
+        }
+
+        /* A frame may have been waiting for a free buffer */
+        if (render_flag)
+        {
+            schedule_preview_frame();
+        }
+
+        return wf::ipc::json_ok();
+    };
+
+    wf::ipc::method_callback release_output = [=] (wf::json_t data)
+    {
+        stream_client = nullptr;
+        if (stream_state != stream_state_t::DESTROYED)
+        {
+            set_stream_state(stream_state_t::RELEASED);
+        }
+
+        return wf::ipc::json_ok();
+    };
+
+    struct snapshot_format_t
+    {
+        std::string encoding;
+        channel_order_t order;
+        bool straight;
+        int dimension;
+    };
+
+    /* Parse the size and encoding options shared by the snapshot methods.
+     * Returns an error message, or an empty string. */
+    std::string parse_snapshot_format(const wf::json_t& data, snapshot_format_t& format)
+    {
+        format.encoding = wf::ipc::json_get_optional_string(data, "encoding").value_or("png");
+        if ((format.encoding != "png") && (format.encoding != "qoi") && (format.encoding != "raw"))
+        {
+            return "encoding must be \"png\", \"qoi\" or \"raw\"";
+        }
+
+        /* PNG and QOI are always straight RGBA, raw follows the export options */
+        std::optional<channel_order_t> order;
+        format.straight = wf::ipc::json_get_optional_bool(data, "straight_alpha").value_or(
+            bool(export_straight_alpha));
+        if (format.encoding != "raw")
+        {
+            format.straight = true;
+        } else if (!parse_channel_order(wf::ipc::json_get_optional_string(data, "channel_order")
+            .value_or(std::string(export_channel_order)), order))
+        {
+            return "channel_order must be one of native, rgba, bgra, argb or abgr";
+        }
+
+        /* Snapshots are read back as RGBA, which is also their native order */
+        format.order = order.value_or(channel_order_t::RGBA);
+
+        int limit = std::max(1, int(inline_max_dimension));
+        format.dimension = std::clamp<int64_t>(
+            wf::ipc::json_get_optional_int64(data, "max_dimension").value_or(limit), 1, limit);
+        return "";
+    }
+
+    /* Allocate snapshot_buffer for area scaled down to fit dimension, and
+     * set up a render target for it */
+    std::optional<wf::render_target_t> begin_snapshot(const wf::geometry_t& area, int dimension)
+    {
+        double scale = std::min(1.0, dimension / double(std::max(area.width, area.height)));
+        wf::dimensions_t size{
+            std::max(1, int(area.width * scale)),
+            std::max(1, int(area.height * scale)),
+        };
+        if (snapshot_buffer.allocate(size) == wf::buffer_reallocation_result_t::FAILED)
+        {
+            return {};
+        }
+
+        wf::render_target_t target{snapshot_buffer.get_renderbuffer()};
+        target.geometry = area;
+        target.scale    = scale;
+        return target;
+    }
+
+    /* Read back snapshot_buffer as premultiplied RGBA and release it.
+     * ABGR8888 is R, G, B, A in memory, which is what both encoders take. */
+    bool read_snapshot(thumbnail_t& thumbnail)
+    {
+        auto size = snapshot_buffer.get_size();
+        thumbnail.width  = size.width;
+        thumbnail.height = size.height;
+        thumbnail.pixels.resize(size.width * size.height * 4);
+        wlr_texture_read_pixels_options options = {};
+        options.data   = thumbnail.pixels.data();
+        options.format = DRM_FORMAT_ABGR8888;
+        options.stride = size.width * 4;
+        bool read = wlr_texture_read_pixels(snapshot_buffer.get_texture(), &options);
+        snapshot_buffer.free();
+        return read;
+    }
+
+    wf::json_t finish_snapshot(const snapshot_format_t& format)
+    {
+        thumbnail_t thumbnail;
+        if (!read_snapshot(thumbnail))
+        {
+            return wf::ipc::json_error("failed to read back snapshot");
+        }
+
+        return encode_snapshot(thumbnail, format);
+    }
+
+    /* Convert a thumbnail to the requested layout and build the reply */
+    wf::json_t encode_snapshot(thumbnail_t& thumbnail, const snapshot_format_t& format)
+    {
+        auto pixels = thumbnail.view();
+        get_workers().parallel_for(pixels.height, [&] (int y0, int y1)
+        {
+            convert_pixels(pixels, channel_order_t::RGBA, format.order, format.straight, y0, y1);
+        });
+
+        auto encoded = (format.encoding == "qoi") ? encode_qoi(pixels) :
+            (format.encoding == "png") ? encode_png(pixels) : thumbnail.pixels;
+        if (encoded.empty())
+        {
+            return wf::ipc::json_error("failed to encode snapshot");
+        }
+
+        auto response = wf::ipc::json_ok();
+        response["width"]    = pixels.width;
+        response["height"]   = pixels.height;
+        response["encoding"] = format.encoding;
+        if (format.encoding == "raw")
+        {
+            response["channel_order"]  = channel_layout(format.order);
+            response["straight_alpha"] = format.straight;
+        }
+
+        response["data"] = base64_encode(encoded);
+        return response;
+    }
+
+    /* One-shot thumbnails for icon-sized consumers: the view is rendered
+     * offscreen, read back and returned inline as base64 PNG or QOI, so no
+     * stream or virtual output is involved. */
+    wf::ipc::method_callback snapshot = [=] (wf::json_t data)
+    {
+        auto view = wf::ipc::find_view_by_id(wf::ipc::json_get_uint64(data, "id"));
+        if (!view || !view->get_output())
+        {
+            return wf::ipc::json_error("no such view");
+        }
+
+        snapshot_format_t format;
+        auto error = parse_snapshot_format(data, format);
+        if (!error.empty())
+        {
+            return wf::ipc::json_error(error);
+        }
+
+        /* Minimized clients often stop rendering, so prefer the thumbnail
+         * taken when the view was minimized. Callers that need an answer
+         * instantly can ask for any cached thumbnail. */
+        bool prefer_cached = wf::ipc::json_get_optional_bool(data, "prefer_cached").value_or(false);
+        auto cached = prefer_cached ? thumbnail_cache.get(view->get_id()) : get_minimized_thumbnail(view);
+        if (cached)
+        {
+            auto thumbnail = fit_thumbnail(*cached, format.dimension);
+            auto response  = encode_snapshot(thumbnail, format);
+            response["cached"] = true;
+            return response;
+        }
+
+        bool main_only = wf::ipc::json_get_optional_bool(data, "main_surface_only").value_or(
+            bool(main_surface_only));
+        int depth = wf::ipc::json_get_optional_int64(data, "subsurface_depth").value_or(
+            int(subsurface_depth));
+
+        const wf::geometry_t bbox = get_preview_bbox(view, main_only);
+        if ((bbox.width <= 0) || (bbox.height <= 0))
+        {
+            return wf::ipc::json_error("view has no content");
+        }
+
+        auto target = begin_snapshot(bbox, format.dimension);
+        if (!target)
+        {
+            return wf::ipc::json_error("failed to allocate snapshot buffer");
+        }
+
+        render_view(view, main_only, depth, &*target);
+        return finish_snapshot(format);
+    };
+
+    /* A copy of thumbnail, area-averaged down if it exceeds dimension */
+    thumbnail_t fit_thumbnail(thumbnail_t& thumbnail, int dimension)
+    {
+        int largest = std::max(thumbnail.width, thumbnail.height);
+        if (largest <= dimension)
+        {
+            return thumbnail;
+        }
+
+        thumbnail_t fitted;
+        fitted.width  = std::max(1, thumbnail.width * dimension / largest);
+        fitted.height = std::max(1, thumbnail.height * dimension / largest);
+        fitted.pixels.resize(fitted.width * fitted.height * 4);
+        downscale_box(thumbnail.view(), fitted.view(), fitted.width, fitted.height, 0, fitted.height);
+        return fitted;
+    }
+
+    /* Render a view into the thumbnail cache at the inline snapshot size */
+    void capture_thumbnail(wayfire_view view)
+    {
+        const wf::geometry_t bbox = get_preview_bbox(view, main_surface_only);
+        if (!view->get_output() || (bbox.width <= 0) || (bbox.height <= 0))
+        {
+            return;
+        }
+
+        auto target = begin_snapshot(bbox, std::max(1, int(inline_max_dimension)));
+        if (!target)
+        {
+            return;
+        }
+
+        render_view(view, main_surface_only, subsurface_depth, &*target);
+        thumbnail_t thumbnail;
+        if (read_snapshot(thumbnail))
+        {
+            thumbnail_cache.put(view->get_id(), std::move(thumbnail));
+        }
+    }
+
+    /* The request is emitted while the view is still on screen, so this
+     * is the last chance to capture it before the client may stop drawing */
+    wf::signal::connection_t<wf::view_minimize_request_signal> on_minimize_request =
+        [=] (wf::view_minimize_request_signal *ev)
+    {
+        if (ev->state && capture_on_minimize && ev->view->is_mapped() && !ev->view->minimized)
+        {
+            capture_thumbnail(ev->view);
+        }
+    };
+
+    wf::signal::connection_t<wf::view_unmapped_signal> on_view_unmapped =
+        [=] (wf::view_unmapped_signal *ev)
+    {
+        thumbnail_cache.erase(ev->view->get_id());
+        prewarm_due.erase(ev->view->get_id());
+        view_activity.erase(ev->view->get_id());
+    };
+
+    /* Queue a thumbnail capture once the view has been left alone for
+     * prewarm_delay. Queueing it again pushes the capture back. */
+    void queue_prewarm(wayfire_view view)
+    {
+        prewarm_due[view->get_id()] = monotonic_ns() / 1000000 + std::max(0, int(prewarm_delay));
+        if (!prewarm_timer.is_connected())
+        {
+            prewarm_timer.set_timeout(std::max(1, int(prewarm_interval)), [=] ()
+            {
+                return prewarm_next();
+            });
+        }
+    }
+
+    /* Capture at most one settled view per tick, so prewarming is rate
+     * limited globally no matter how many views map at once. Returns
+     * whether the timer should keep running. */
+    bool prewarm_next()
+    {
+        int64_t now = monotonic_ns() / 1000000;
+        auto next   = prewarm_due.end();
+        for (auto it = prewarm_due.begin(); it != prewarm_due.end(); ++it)
+        {
+            if ((it->second <= now) && ((next == prewarm_due.end()) || (it->second < next->second)))
+            {
+                next = it;
+            }
+        }
+
+        /* Streams and on-screen frames take priority over prewarming */
+        if ((next != prewarm_due.end()) && !low_power && (stream_state != stream_state_t::ACTIVE))
+        {
+            auto view = wf::ipc::find_view_by_id(next->first);
+            prewarm_due.erase(next);
+            auto toplevel = toplevel_cast(view);
+            if (toplevel && toplevel->is_mapped() && !toplevel->minimized)
+            {
+                capture_thumbnail(view);
+            }
+        }
+
+        return !prewarm_due.empty();
+    }
+
+    wf::signal::connection_t<wf::view_mapped_signal> on_view_mapped = [=] (wf::view_mapped_signal *ev)
+    {
+        if (prewarm_thumbnails && toplevel_cast(ev->view))
+        {
+            ev->view->connect(&on_prewarm_geometry_changed);
+            queue_prewarm(ev->view);
+        }
+    };
+
+    /* Moves don't change what a thumbnail looks like, large resizes do */
+    wf::signal::connection_t<wf::view_geometry_changed_signal> on_prewarm_geometry_changed =
+        [=] (wf::view_geometry_changed_signal *ev)
+    {
+        auto toplevel = toplevel_cast(ev->view);
+        if (!prewarm_thumbnails || !toplevel || !toplevel->is_mapped())
+        {
+            return;
+        }
+
+        auto old_size = ev->old_geometry;
+        auto new_size = toplevel->get_geometry();
+        int threshold = std::max(0, int(prewarm_resize_threshold));
+        auto changed  = [=] (int from, int to)
+        {
+            return std::abs(to - from) * 100 > threshold * std::max(1, from);
+        };
+        if (changed(old_size.width, new_size.width) || changed(old_size.height, new_size.height))
+        {
+            queue_prewarm(ev->view);
+        }
+    };
+
+    /* Walk the surfaces under node front to back, relative to the output
+     * at origin. A surface whose part of area is already covered by opaque
+     * surfaces in front of it is counted in culled; every surface then adds
+     * its opaque region to covered. Surfaces under anything but a
+     * whole-pixel translation are skipped, so culling only ever errs
+     * towards drawing. */
+    void cull_surfaces(const scene::node_ptr& node, wf::point_t origin, const wf::geometry_t& area,
+        wf::region_t& covered, int& culled)
+    {
+        if (!node->is_enabled())
+        {
+            return;
+        }
+
+        if (auto surface = dynamic_cast<scene::opaque_region_node_t*>(node.get()))
+        {
+            auto a = node->to_global({0, 0});
+            auto b = node->to_global({1, 1});
+            if ((b.x - a.x == 1.0) && (b.y - a.y == 1.0) &&
+                (a.x == std::floor(a.x)) && (a.y == std::floor(a.y)))
+            {
+                wf::point_t offset{int(a.x) - origin.x, int(a.y) - origin.y};
+                wf::region_t visible = (wf::region_t{node->get_bounding_box()} + offset) &
+                    wf::region_t{area};
+                visible ^= visible & covered;
+                if (visible.empty())
+                {
+                    culled++;
+                }
+
+                covered |= surface->get_opaque_region() + offset;
+            }
+        }
+
+        for (auto& child : node->get_children())
+        {
+            cull_surfaces(child, origin, area, covered, culled);
+        }
+    }
+
+    /* Thumbnails of a whole workspace, or of a group of windows given by
+     * "views", composited in stacking order. Walking the windows top to
+     * bottom, any window whose part of the thumbnail is already covered by
+     * opaque surfaces above it is culled before the render pass. Inside
+     * the remaining windows, fully covered surfaces are counted the same
+     * way; the render pass gives them no instructions, since it subtracts
+     * each surface's opaque region from the damage of those below. */
+    wf::ipc::method_callback workspace_snapshot = [=] (wf::json_t data)
+    {
+        snapshot_format_t format;
+        auto error = parse_snapshot_format(data, format);
+        if (!error.empty())
+        {
+            return wf::ipc::json_error(error);
+        }
+
+        wf::output_t *output = nullptr;
+        std::vector<wayfire_toplevel_view> views;
+        wf::geometry_t area;
+        if (data.has_member("views"))
+        {
+            if (!data["views"].is_array())
+            {
+                return wf::ipc::json_error("views must be an array of view ids");
+            }
+
+            std::vector<wayfire_view> group;
+            for (size_t i = 0; i < data["views"].size(); i++)
+            {
+                auto view = wf::ipc::find_view_by_id(data["views"][i].as_uint64());
+                if (!view || !view->get_output() || (output && (view->get_output() != output)))
+                {
+                    return wf::ipc::json_error("views must be mapped and on the same output");
+                }
+
+                output = view->get_output();
+                group.push_back(view);
+            }
+
+            if (group.empty())
+            {
+                return wf::ipc::json_error("no such views");
+            }
+
+            for (auto view : output->wset()->get_views(WSET_MAPPED_ONLY | WSET_SORT_STACKING))
+            {
+                if (std::find(group.begin(), group.end(), view) == group.end())
+                {
+                    continue;
+                }
+
+                auto bbox = view->get_root_node()->get_bounding_box();
+                area = views.empty() ? bbox : wf::geometry_t((wf::region_t{area} | bbox).get_extents());
+                views.push_back(view);
+            }
+
+            if (views.empty())
+            {
+                return wf::ipc::json_error("no such views");
+            }
+        } else
+        {
+            output = data.has_member("output_id") ?
+                wf::ipc::find_output_by_id(wf::ipc::json_get_int64(data, "output_id")) :
+                wf::get_core().seat->get_active_output();
+            if (!output)
+            {
+                return wf::ipc::json_error("no such output");
+            }
+
+            auto current = output->wset()->get_current_workspace();
+            wf::point_t workspace{
+                int(wf::ipc::json_get_optional_int64(data, "x").value_or(current.x)),
+                int(wf::ipc::json_get_optional_int64(data, "y").value_or(current.y)),
+            };
+            auto og = output->get_relative_geometry();
+            area = {(workspace.x - current.x) * og.width, (workspace.y - current.y) * og.height,
+                og.width, og.height};
+            views = output->wset()->get_views(
+                WSET_MAPPED_ONLY | WSET_EXCLUDE_MINIMIZED | WSET_SORT_STACKING, workspace);
+        }
+
+        if ((area.width <= 0) || (area.height <= 0))
+        {
+            return wf::ipc::json_error("nothing to render");
+        }
+
+        auto layout = output->get_layout_geometry();
+        std::vector<scene::render_instance_uptr> instances;
+        wf::region_t covered;
+        int culled = 0;
+        int culled_surfaces = 0;
+        for (auto view : views)
+        {
+            wf::region_t visible = wf::region_t{view->get_root_node()->get_bounding_box()} &
+                wf::region_t{area};
+            visible ^= visible & covered;
+            if (visible.empty())
+            {
+                culled++;
+                continue;
+            }
+
+            view->get_root_node()->gen_render_instances(instances, [] (auto) {}, output);
+            cull_surfaces(view->get_root_node(), {layout.x, layout.y}, area, covered, culled_surfaces);
+        }
+
+        auto target = begin_snapshot(area, format.dimension);
+        if (!target)
+        {
+            return wf::ipc::json_error("failed to allocate snapshot buffer");
+        }
+
+        render_pass_params_t params;
+        params.background_color = {0, 0, 0, 0};
+        params.damage    = area;
+        params.target    = *target;
+        params.instances = &instances;
+        params.flags     = RPASS_CLEAR_BACKGROUND;
+        render_pass_t::run(params);
+
+        auto response = finish_snapshot(format);
+        if (response.has_member("data"))
+        {
+            response["views"]  = int(views.size());
+            response["culled"] = culled;
+            response["culled_surfaces"] = culled_surfaces;
+        }
+
+        return response;
+    };
+
+    /* Start counting damage on a view. The render instances are only
+     * used for their damage callbacks, nothing is ever rendered. */
+    void track_activity(wayfire_view view)
+    {
+        if (view_activity.count(view->get_id()))
+        {
+            return;
+        }
+
+        auto activity = std::make_unique<view_activity_t>();
+        auto counters = activity.get();
+        std::vector<scene::node_ptr> nodes = {view->get_root_node()};
+        activity->instances = std::make_unique<wf::scene::render_instance_manager_t>(nodes,
+            [counters] (const wf::region_t& damage)
+        {
+            counters->damage_events++;
+            for (const auto& box : damage)
+            {
+                counters->damaged_pixels += double(box.x2 - box.x1) * (box.y2 - box.y1);
+            }
+        }, view->get_output());
+        activity->instances->set_visibility_region(view->get_root_node()->get_bounding_box());
+        view_activity[view->get_id()] = std::move(activity);
+    }
+
+    /* Stop counting damage on views no client watches anymore */
+    void prune_activity()
+    {
+        for (auto it = view_activity.begin(); it != view_activity.end();)
+        {
+            bool watched = false;
+            for (auto& [client, ids] : activity_watchers)
+            {
+                watched |= std::find(ids.begin(), ids.end(), it->first) != ids.end();
+            }
+
+            it = watched ? std::next(it) : view_activity.erase(it);
+        }
+
+        if (activity_watchers.empty())
+        {
+            activity_timer.disconnect();
+        }
+    }
+
+    /* Send every watcher one event covering all the views it watches, with
+     * damage events per second and the damaged area per second as a
+     * fraction of the view's size, then start a new interval */
+    bool report_activity()
+    {
+        int64_t now = monotonic_ns();
+        double seconds = std::max(1e-3, (now - activity_last_report) / 1e9);
+        activity_last_report = now;
+        for (auto& [client, ids] : activity_watchers)
+        {
+            wf::json_t event;
+            event["event"] = "live_previews/activity";
+            event["views"] = wf::json_t::array();
+            for (auto id : ids)
+            {
+                auto it   = view_activity.find(id);
+                auto view = wf::ipc::find_view_by_id(id);
+                if ((it == view_activity.end()) || !view)
+                {
+                    continue;
+                }
+
+                auto bbox = view->get_root_node()->get_bounding_box();
+                double area = std::max(1.0, double(bbox.width) * bbox.height);
+                wf::json_t entry;
+                entry["id"] = id;
+                entry["damage_rate"] = it->second->damage_events / seconds;
+                entry["damage_area"] = it->second->damaged_pixels / area / seconds;
+                event["views"].append(entry);
+            }
+
+            client->send_json(event);
+        }
+
+        for (auto& [id, activity] : view_activity)
+        {
+            activity->damage_events  = 0;
+            activity->damaged_pixels = 0.0;
+        }
+
+        return !activity_watchers.empty();
+    }
+
+    /* Replace the calling client's set of watched views. An empty list
+     * stops its reports. */
+    wf::ipc::method_callback_full watch_activity = [=] (wf::json_t data, wf::ipc::client_interface_t *client)
+    {
+        if (!data.has_member("views") || !data["views"].is_array())
+        {
+            return wf::ipc::json_error("views must be an array of view ids");
+        }
+
+        std::vector<wayfire_view> views;
+        for (size_t i = 0; i < data["views"].size(); i++)
+        {
+            auto view = wf::ipc::find_view_by_id(data["views"][i].as_uint64());
+            if (!view || !view->is_mapped() || !view->get_output())
+            {
+                return wf::ipc::json_error("views must be mapped");
+            }
+
+            views.push_back(view);
+        }
+
+        activity_watchers.erase(client);
+        if (!views.empty())
+        {
+            auto& ids = activity_watchers[client];
+            for (auto view : views)
+            {
+                ids.push_back(view->get_id());
+                track_activity(view);
+            }
+        }
+
+        prune_activity();
+        if (!activity_watchers.empty() && !activity_timer.is_connected())
+        {
+            activity_last_report = monotonic_ns();
+            activity_timer.set_timeout(std::max(1, int(activity_interval)), [=] ()
+            {
+                return report_activity();
+            });
+        }
+
+        return wf::ipc::json_ok();
+    };
+
+    wf::signal::connection_t<wf::ipc::client_disconnected_signal> on_client_disconnected =
+        [=] (wf::ipc::client_disconnected_signal *ev)
+    {
+        if (activity_watchers.erase(ev->client))
+        {
+            prune_activity();
+        }
+
+        /* Nobody is left to call release_output, so do it for them */
+        if (ev->client == stream_client)
+        {
+            stream_client = nullptr;
+            if (swapchain)
+            {
+                swapchain->release_all();
+            }
+
+            if (stream_state != stream_state_t::DESTROYED)
+            {
+                set_stream_state(stream_state_t::RELEASED);
+            }
+        }
+    };
+
+    /* Tell the consumer its stream is gone so it can stop capturing */
+    void send_stream_ended(std::string reason)
+    {
+        if (!stream_client)
+        {
+            return;
+        }
+
+        wf::json_t event;
+        event["event"]  = "live_previews/stream_ended";
+        event["id"]     = stream_view_id;
+        event["reason"] = reason;
+        stream_client->send_json(event);
+        stream_client = nullptr;
+    }
+
+    /* Withdraw the preview output's wl_output global from clients. Output
+     * capture needs the global, so this is opt-in for consumers that only
+     * use shm buffers. The output stays in the layout: the pointer is clamped to the nearest
+     * point of the layout after every move, so no placement keeps it out.
+     * Only destroy_output removes the output from the layout. */
+    void hide_preview_output()
+    {
+        if (!wo || !hide_output)
+        {
+            return;
+        }
+
+        wlr_output_destroy_global(wo->handle);
+    }
+
+    /* The core may create the global again when it reconfigures outputs */
+    wf::signal::connection_t<wf::output_layout_configuration_changed_signal> on_layout_changed =
+        [=] (wf::output_layout_configuration_changed_signal *ev)
+    {
+        hide_preview_output();
+    };
+
+    /* shm frames are rendered into the swapchain, never into the output,
+     * so the output only needs a frame's size when it is captured itself */
+    wf::dimensions_t get_output_size(wf::dimensions_t frame_size)
+    {
+        return stream_shm ? wf::dimensions_t{1, 1} : frame_size;
+    }
+
+    bool fit_output(wf::dimensions_t frame_size)
+    {
+        auto size = get_output_size(frame_size);
+        if ((wo->handle->width == size.width) && (wo->handle->height == size.height))
+        {
+            return true;
+        }
+
+        return resize_output(size);
+    }
+
+    bool resize_output(wf::dimensions_t size)
+    {
+        wlr_output_state state;
+        wlr_output_state_init(&state);
+        wlr_output_state_set_custom_mode(&state, size.width, size.height, 0);
+        bool committed = wlr_output_test_state(wo->handle, &state) &&
+            wlr_output_commit_state(wo->handle, &state);
+        wlr_output_state_finish(&state);
+
+        return committed;
+    }
+
+    /* Shrink the idle output to 1x1 so its swapchain is reallocated tiny
+     * on the next repaint, while the output itself stays around. */
+    void release_output_buffers()
+    {
+        if (!wo || !resize_output({1, 1}))
+        {
+            return;
+        }
+
+        current_size = {1, 1};
+        wo->render->damage_whole();
+    }
+
+    void start_stream(wayfire_view view, wf::ipc::client_interface_t *client)
+    {
+        current_preview = view;
+        stream_client   = client;
+        stream_view_id  = view->get_id();
+        set_stream_state(stream_state_t::ACTIVE);
+    }
+
+    /* Detach from the previewed view and stop rendering into the output */
+    void stop_stream()
+    {
+        destroy_render_instance_manager();
+        view_unmapped.disconnect();
+        current_preview = nullptr;
+        full_size_buffer.free();
+        invalidate_layer_cache();
+        layer_cache.free();
+        layer_scratch.free();
+        swapchain.reset();
+        held_buffers_timer.disconnect();
+        unhook_physical_outputs();
+        cancel_preview_frame();
+        if (hook_set)
+        {
+            wo->render->rem_post(&post_hook);
+            hook_set = false;
+        }
+    }
+
+    void set_stream_state(stream_state_t state)
+    {
+        switch (state)
+        {
+          case stream_state_t::REQUESTED:
+            output_destroy_timer.disconnect();
+            output_idle_timer.disconnect();
+            backend_destroy_timer.disconnect();
+            stop_stream();
+            break;
+
+          case stream_state_t::ACTIVE:
+            last_frame_hash  = 0;
+            frame_backoff_ms = 0;
+            serve_thumbnail  = !is_native_stream() && get_minimized_thumbnail(current_preview);
+            if (!hook_set)
+            {
+                wo->render->add_post(&post_hook);
+                hook_set = true;
+            }
+
+            current_preview->connect(&view_unmapped);
+            if (defer_to_idle)
+            {
+                for (auto output : wf::get_core().output_layout->get_outputs())
+                {
+                    hook_physical_output(output);
+                }
+            }
+
+            if (stream_shm)
+            {
+                swapchain = std::make_unique<shm_swapchain_t>();
+            }
+
+            destroy_render_instance_manager();
+            create_render_instance_manager(current_preview);
+            current_preview->get_output()->render->damage_whole();
+            wo->render->damage_whole();
+            current_preview->damage();
+            if (serve_thumbnail)
+            {
+                /* Minimized views are disabled in the scene, so their
+                 * damage may never reach us */
+                render_flag = true;
+                schedule_preview_frame();
+            }
+
+            break;
+
+          case stream_state_t::SUSPENDED:
+          case stream_state_t::RELEASED:
+            stop_stream();
+            output_destroy_timer.disconnect();
+            if (destroy_output_after_timeout)
+            {
+                output_destroy_timer.set_timeout(output_destroy_timeout_ms, [=] ()
+                {
+                    destroy_output();
+                });
+            }
+
+            output_idle_timer.disconnect();
+            if (release_buffers_timeout > 0)
+            {
+                output_idle_timer.set_timeout(release_buffers_timeout, [=] ()
+                {
+                    release_output_buffers();
+                });
+            }
+
+            if (headless_backend)
+            {
+                arm_backend_teardown();
+            }
+
+            break;
+
+          case stream_state_t::DESTROYED:
+            output_destroy_timer.disconnect();
+            output_idle_timer.disconnect();
+            stop_stream();
+            if (headless_backend)
+            {
+                arm_backend_teardown();
+            }
+
+            break;
+        }
+
+        stream_state = state;
+    }
+
+    /* Render the main surface and its shallow subsurfaces, one pass per
+     * surface since each node renders relative to its own origin. */
+    void render_surfaces(wayfire_view view, int depth, wf::render_target_t *target)
+    {
+        std::vector<preview_surface_t> surfaces;
+        collect_surfaces(view->get_wlr_surface(), {0, 0}, depth, surfaces);
+
+        auto root_node = view->get_surface_root_node();
+        uint32_t flags = RPASS_CLEAR_BACKGROUND;
+        for (auto& s : surfaces)
+        {
+            auto node = find_surface_node(root_node, s.surface);
+            if (!node)
+            {
+                continue;
+            }
+
+            std::vector<scene::render_instance_uptr> instances;
+            node->gen_render_instances(instances, [] (auto) {}, view->get_output());
+
+            render_pass_params_t params;
+            params.background_color = {0, 0, 0, 0};
+            params.target = *target;
+            params.target.geometry.x -= s.offset.x;
+            params.target.geometry.y -= s.offset.y;
+            params.damage    = params.target.geometry;
+            params.instances = &instances;
+            params.flags     = flags;
+            render_pass_t::run(params);
+            flags = 0;
+        }
+    }
+
+    void take_snapshot(wf::render_target_t *target)
+    {
+        const wf::geometry_t bbox = get_preview_bbox(current_preview);
+
+        current_scale = (bbox.width < bbox.height) ?
+            (stream_dimension / double(bbox.height)) :
+            (stream_dimension / double(bbox.width));
+
+        target->geometry = bbox;
+        target->scale    = current_scale;
+        render_preview(target);
+    }
+
+    /* Render the preview into a target whose geometry and scale are set up */
+    void render_preview(wf::render_target_t *target)
+    {
+        render_view(current_preview, surface_only, surface_depth, target);
+    }
+
+    void render_view(wayfire_view view, bool main_only, int depth, wf::render_target_t *target)
+    {
+        if (main_only && view->get_wlr_surface())
+        {
+            render_surfaces(view, depth, target);
+            return;
+        }
+
+        render_root(view, target, target->geometry);
+    }
+
+    /* Render the view's surface root, clearing and repainting only damage */
+    void render_root(wayfire_view view, wf::render_target_t *target, const wf::region_t& damage)
+    {
+        auto root_node = view->get_surface_root_node();
+        std::vector<scene::render_instance_uptr> instances;
+        root_node->gen_render_instances(instances, [] (auto) {}, view->get_output());
+
+        render_pass_params_t params;
+        params.background_color = {0, 0, 0, 0};
+        params.damage    = damage;
+        params.target    = *target;
+        params.instances = &instances;
+        params.flags     = RPASS_CLEAR_BACKGROUND;
+        render_pass_t::run(params);
+    }
+
+    worker_pool_t& get_workers()
+    {
+        if (!workers)
+        {
+            int threads = worker_threads;
+            if (threads <= 0)
+            {
+                threads = std::clamp(int(std::thread::hardware_concurrency()) - 1, 0, 7);
+            }
+
+            workers = std::make_unique<worker_pool_t>(threads);
+        }
+
+        return *workers;
+    }
+
+    bool use_software_path()
+    {
+        return software_downscale && !low_power && wlr_renderer_is_pixman(wf::get_core().renderer);
+    }
+
+    /* Render the preview into an intermediate buffer, then area-average it
+     * into dst in bands on the worker pool. When the preview is at least
+     * halved, the intermediate is rendered at exactly 2, 4 or 8 times the
+     * preview size so the fixed-tap SIMD kernels apply; otherwise it is
+     * rendered unscaled and reduced with the generic box filter. Returns
+     * false if the buffers can't be mapped, in which case the caller falls
+     * back to a scaled render pass. */
+    bool take_snapshot_software(const wf::render_buffer_t& dst)
+    {
+        const wf::geometry_t bbox = get_preview_bbox(current_preview);
+        if ((bbox.width <= 0) || (bbox.height <= 0))
+        {
+            return false;
+        }
+
+        current_scale = (bbox.width < bbox.height) ?
+            (stream_dimension / double(bbox.height)) :
+            (stream_dimension / double(bbox.width));
+        int width  = std::clamp(int(bbox.width * current_scale), 1, dst.get_size().width);
+        int height = std::clamp(int(bbox.height * current_scale), 1, dst.get_size().height);
+
+        int factor = 1;
+        while ((factor < 8) && (factor * 2 * current_scale <= 1.0))
+        {
+            factor *= 2;
+        }
+
+        wf::dimensions_t size = (factor > 1) ?
+            wf::dimensions_t{width * factor, height * factor} :
+            wf::dimensions_t{bbox.width, bbox.height};
+        if (full_size_buffer.allocate(size) == wf::buffer_reallocation_result_t::FAILED)
+        {
+            return false;
+        }
+
+        wf::render_target_t target{full_size_buffer.get_renderbuffer()};
+        target.geometry = bbox;
+        target.scale    = (factor > 1) ? factor * current_scale : 1.0;
+        render_preview(&target);
+
+        mapped_buffer_t src{full_size_buffer.get_buffer(), WLR_BUFFER_DATA_PTR_ACCESS_READ};
+        mapped_buffer_t out{dst.get_buffer(), WLR_BUFFER_DATA_PTR_ACCESS_WRITE};
+        if (!src || !out || (src.format != out.format))
+        {
+            return false;
+        }
+
+        get_workers().parallel_for(out.pixels.height, [&] (int y0, int y1)
+        {
+            int rows = std::min(y1, height);
+            if ((y0 < rows) && !downscale_pow2(factor, src.pixels, out.pixels, width, y0, rows))
+            {
+                downscale_box(src.pixels, out.pixels, width, height, y0, rows);
+            }
+
+            clear_outside(out.pixels, width, height, y0, y1);
+        });
+
+        return true;
+    }
+
+    /* Rewrite a finished shm frame into the consumer's requested layout, so
+     * toolkits that want straight alpha or another byte order don't have
+     * to walk every pixel themselves. Only ever applied to buffers whose
+     * layout is announced to the consumer; the output's own buffers stay
+     * premultiplied ABGR8888, as they are advertised. */
+    void convert_for_export(wlr_buffer *buffer)
+    {
+        if (!stream_order && !stream_straight)
+        {
+            return;
+        }
+
+        mapped_buffer_t out{buffer,
+            WLR_BUFFER_DATA_PTR_ACCESS_READ | WLR_BUFFER_DATA_PTR_ACCESS_WRITE};
+        if (!out)
+        {
+            return;
+        }
+
+        auto order    = stream_order.value_or(out.order);
+        bool straight = stream_straight && out.has_alpha();
+        if ((out.order == order) && !straight)
+        {
+            return;
+        }
+
+        get_workers().parallel_for(out.pixels.height, [&] (int y0, int y1)
+        {
+            convert_pixels(out.pixels, out.order, order, straight, y0, y1);
+        });
+    }
+
+    /* True if the view's preview is exactly its main surface: no mapped
+     * subsurfaces and nothing like decorations around it in the scene. */
+    bool is_single_surface(wayfire_view view)
+    {
+        auto surface = view->get_wlr_surface();
+        if (surface_only && (surface_depth == 0))
+        {
+            return true;
+        }
+
+        if (!wl_list_empty(&surface->current.subsurfaces_below) ||
+            !wl_list_empty(&surface->current.subsurfaces_above))
+        {
+            return false;
+        }
+
+        /* Anything else under the surface root, even if it lies inside the
+         * surface's bounds, is drawn over or under the client's buffer */
+        auto root      = view->get_surface_root_node();
+        auto children  = root->get_children();
+        auto main_node = (children.size() == 1) ?
+            dynamic_cast<scene::wlr_surface_node_t*>(children.front().get()) : nullptr;
+        if (!main_node || (main_node->get_surface() != surface) || !main_node->get_children().empty())
+        {
+            return false;
+        }
+
+        auto bbox = root->get_bounding_box();
+        return surface_only ||
+               ((bbox.width == surface->current.width) && (bbox.height == surface->current.height));
+    }
+
+    /* The client's committed buffer, if the preview is exactly that buffer
+     * drawn untransformed, or nullptr whenever composition is needed */
+    wlr_buffer *get_plain_client_buffer(wayfire_view view)
+    {
+        auto surface = view->get_wlr_surface();
+        if (!surface || !surface->buffer || !surface->buffer->source ||
+            (surface->current.transform != WL_OUTPUT_TRANSFORM_NORMAL) ||
+            surface->current.viewport.has_src || surface->current.viewport.has_dst ||
+            !is_single_surface(view))
+        {
+            return nullptr;
+        }
+
+        return surface->buffer->source;
+    }
+
+    /* Single-surface views backed by a plain shm buffer, like most terminals,
+     * are area-averaged straight from the client's committed buffer on the
+     * worker pool, without a render pass or intermediate buffer. Only the
+     * software renderer gives us a mappable dst. Returns false whenever
+     * composition is needed, and the generic path runs. */
+    bool downscale_client_buffer(const wf::render_buffer_t& dst)
+    {
+        auto buffer = (direct_downscale && wlr_renderer_is_pixman(wf::get_core().renderer)) ?
+            get_plain_client_buffer(current_preview) : nullptr;
+        if (!buffer)
+        {
+            return false;
+        }
+
+        auto surface = current_preview->get_wlr_surface();
+        mapped_buffer_t src{buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ};
+        if (!src)
+        {
+            return false;
+        }
+
+        mapped_buffer_t out{dst.get_buffer(), WLR_BUFFER_DATA_PTR_ACCESS_WRITE};
+        if (!out)
+        {
+            return false;
+        }
+
+        const wf::geometry_t bbox = {0, 0, surface->current.width, surface->current.height};
+        current_scale = (bbox.width < bbox.height) ?
+            (stream_dimension / double(bbox.height)) :
+            (stream_dimension / double(bbox.width));
+        int width  = std::clamp(int(bbox.width * current_scale), 1, out.pixels.width);
+        int height = std::clamp(int(bbox.height * current_scale), 1, out.pixels.height);
+
+        int factor = src.pixels.width / width;
+        bool exact = (factor * width == src.pixels.width) && (factor * height == src.pixels.height);
+        pixel_view_t content{out.pixels.data, out.pixels.stride, width, height};
+        get_workers().parallel_for(out.pixels.height, [&] (int y0, int y1)
+        {
+            int rows = std::min(y1, height);
+            if (y0 < rows)
+            {
+                if (!exact || !downscale_pow2(factor, src.pixels, out.pixels, width, y0, rows))
+                {
+                    downscale_box(src.pixels, out.pixels, width, height, y0, rows);
+                }
+
+                if (!src.has_alpha())
+                {
+                    set_opaque(out.pixels, width, y0, rows);
+                }
+
+                convert_pixels(content, src.order, out.order, false, y0, rows);
+            }
+
+            clear_outside(out.pixels, width, height, y0, y1);
+        });
+
+        return true;
+    }
+
+    void invalidate_layer_cache()
+    {
+        layer_valid = false;
+        layer_damage.clear();
+        row_hashes.clear();
+        scroll_residual = 0.0;
+        scroll_settle_timer.disconnect();
+    }
+
+    /* Copy rows of src into dst moved up by dy pixels (down if negative),
+     * overwriting what is there. Rows moved in from outside are left as
+     * they were. */
+    bool copy_texture(wlr_texture *src, wlr_buffer *dst, wf::dimensions_t size, int dy)
+    {
+        int height = size.height - std::abs(dy);
+        if (height <= 0)
+        {
+            return false;
+        }
+
+        auto pass = wlr_renderer_begin_buffer_pass(wf::get_core().renderer, dst, nullptr);
+        if (!pass)
+        {
+            return false;
+        }
+
+        wlr_render_texture_options options = {};
+        options.texture    = src;
+        options.src_box    = {0, double(std::max(dy, 0)), double(size.width), double(height)};
+        options.dst_box    = {0, std::max(-dy, 0), size.width, height};
+        options.blend_mode = WLR_RENDER_BLEND_MODE_NONE;
+        wlr_render_pass_add_texture(pass, &options);
+        return wlr_render_pass_submit(pass);
+    }
+
+    /* Hash every row of the client's buffer, for views whose preview is
+     * exactly that buffer. Returns an empty list otherwise. Only the
+     * software renderer keeps the committed buffer locked after upload;
+     * GPU renderers hand it back to the client, which may already be
+     * drawing the next frame into it. */
+    std::vector<uint64_t> hash_client_rows()
+    {
+        auto buffer = (detect_scrolling && wlr_renderer_is_pixman(wf::get_core().renderer)) ?
+            get_plain_client_buffer(current_preview) : nullptr;
+        if (!buffer)
+        {
+            return {};
+        }
+
+        mapped_buffer_t src{buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ};
+        if (!src)
+        {
+            return {};
+        }
+
+        std::vector<uint64_t> hashes(src.pixels.height);
+        get_workers().parallel_for(src.pixels.height, [&] (int y0, int y1)
+        {
+            hash_rows(src.pixels, hashes.data(), y0, y1);
+        });
+
+        return hashes;
+    }
+
+    /* When the client's rows show that its content scrolled, move the
+     * cached preview by the same amount and return just the rows that
+     * still differ, which is mostly the newly exposed strip. Sub-pixel
+     * remainders are carried over, and the preview is re-rendered in full
+     * once scrolling stops, to undo any rounding. */
+    wf::region_t get_scroll_damage(const wf::geometry_t& bbox, const std::vector<uint64_t>& hashes,
+        const wf::region_t& damage)
+    {
+        int shift = find_vertical_shift(row_hashes, hashes);
+        if (shift != 0)
+        {
+            scroll_residual += shift * bbox.height * current_scale / hashes.size();
+            int pixels = std::lround(scroll_residual);
+            scroll_residual -= pixels;
+            if ((pixels != 0) &&
+                ((layer_scratch.allocate(layer_cache.get_size()) == wf::buffer_reallocation_result_t::FAILED) ||
+                 !copy_texture(layer_cache.get_texture(), layer_scratch.get_buffer(),
+                     layer_cache.get_size(), pixels) ||
+                 !copy_texture(layer_scratch.get_texture(), layer_cache.get_buffer(),
+                     layer_cache.get_size(), 0)))
+            {
+                return bbox;
+            }
+
+            scroll_settle_timer.disconnect();
+            scroll_settle_timer.set_timeout(100, [=] ()
+            {
+                layer_valid = false;
+                render_flag = true;
+                schedule_preview_frame();
+            });
+        }
+
+        wf::region_t changed;
+        double row_height = bbox.height / double(hashes.size());
+        for (int y = 0; y < int(hashes.size());)
+        {
+            auto matches = [&] (int row)
+            {
+                int prev = row + shift;
+                return (prev >= 0) && (prev < int(row_hashes.size())) && (row_hashes[prev] == hashes[row]);
+            };
+
+            if (matches(y))
+            {
+                y++;
+                continue;
+            }
+
+            int start = y;
+            while ((y < int(hashes.size())) && !matches(y))
+            {
+                y++;
+            }
+
+            int y0 = bbox.y + std::floor(start * row_height);
+            int y1 = bbox.y + std::ceil(y * row_height);
+            changed |= wf::geometry_t{bbox.x, y0, bbox.width, y1 - y0};
+        }
+
+        /* Scrolling damages everything, the rows tell what really changed */
+        return (shift != 0) ? changed : (changed & damage);
+    }
+
+    /* Keep the scaled preview in a persistent buffer and only re-render the
+     * parts of it that were damaged since the last frame, so static parts
+     * like decorations and toolbars aren't resampled every frame. The
+     * result is then copied into dst, since output buffers rotate. Only
+     * used when damage and preview share coordinates, i.e. for whole views
+     * without transformers. */
+    bool render_cached(const wf::render_buffer_t& dst)
+    {
+        if (!cache_layers || surface_only)
+        {
+            return false;
+        }
+
+        const wf::geometry_t bbox = get_preview_bbox(current_preview);
+        if ((bbox.width <= 0) || (bbox.height <= 0) ||
+            (current_preview->get_root_node()->get_bounding_box() != bbox))
+        {
+            return false;
+        }
+
+        current_scale = (bbox.width < bbox.height) ?
+            (stream_dimension / double(bbox.height)) :
+            (stream_dimension / double(bbox.width));
+
+        auto result = layer_cache.allocate(dst.get_size());
+        if (result == wf::buffer_reallocation_result_t::FAILED)
+        {
+            return false;
+        }
+
+        wf::region_t damage = layer_damage;
+        bool rebuild = (result == wf::buffer_reallocation_result_t::REALLOCATED) || !layer_valid ||
+            (layer_bbox != bbox) || (layer_scale != current_scale);
+
+        /* Rows are only hashed when most of the view is damaged, as on
+         * scrolling, where the full re-render this may save costs more
+         * than reading the buffer once. Hashes from a frame that wasn't
+         * hashed would be stale, so they are dropped. */
+        double damaged = 0.0;
+        for (const auto& box : damage)
+        {
+            damaged += double(box.x2 - box.x1) * (box.y2 - box.y1);
+        }
+
+        std::vector<uint64_t> hashes;
+        if (!rebuild && (damaged * 2 >= double(bbox.width) * bbox.height))
+        {
+            hashes = hash_client_rows();
+        }
+
+        if (rebuild)
+        {
+            damage = bbox;
+        } else
+        {
+            if (!hashes.empty() && (hashes.size() == row_hashes.size()))
+            {
+                damage = get_scroll_damage(bbox, hashes, damage);
+            }
+
+            /* Cover the filter footprint around damaged pixels */
+            damage.expand_edges(std::ceil(1.0 / current_scale) + 1);
+            damage &= bbox;
+        }
+
+        layer_damage.clear();
+        row_hashes = std::move(hashes);
+        if (!damage.empty())
+        {
+            wf::render_target_t target{layer_cache.get_renderbuffer()};
+            target.geometry = bbox;
+            target.scale    = current_scale;
+            render_root(current_preview, &target, damage);
+        }
+
+        layer_bbox  = bbox;
+        layer_scale = current_scale;
+        layer_valid = true;
+
+        return copy_texture(layer_cache.get_texture(), dst.get_buffer(), dst.get_size(), 0);
+    }
+
+    /* Hash a finished frame if it is CPU-mappable. Reading GPU buffers
+     * back would stall the main thread every frame, which costs more than
+     * the frames the backoff saves, so those return 0. */
+    uint64_t hash_frame(wlr_buffer *buffer)
+    {
+        mapped_buffer_t mapped{buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ};
+        if (!mapped)
+        {
+            return 0;
+        }
+
+        auto& pixels = mapped.pixels;
+        std::vector<uint64_t> rows(pixels.height);
+        get_workers().parallel_for(pixels.height, [&] (int y0, int y1)
+        {
+            hash_rows(pixels, rows.data(), y0, y1);
+        });
+
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (auto row : rows)
+        {
+            hash = (hash ^ row) * 0x100000001b3ULL;
+        }
+
+        return hash;
+    }
+
+    /* Clients that damage their whole surface every frame while showing
+     * the same image get their preview rate halved with each identical
+     * frame, down to one per adaptive_max_interval. The first frame that
+     * differs, or one that can't be hashed, restores the full rate. */
+    void update_frame_backoff(wlr_buffer *buffer)
+    {
+        if (!adaptive_rate)
+        {
+            frame_backoff_ms = 0;
+            return;
+        }
+
+        const int min_backoff_ms = 16;
+        uint64_t hash = hash_frame(buffer);
+        if ((hash == 0) || (hash != last_frame_hash))
+        {
+            frame_backoff_ms = 0;
+        } else
+        {
+            frame_backoff_ms = std::min(std::max(min_backoff_ms, frame_backoff_ms * 2),
+                std::max(min_backoff_ms, int(adaptive_max_interval)));
+        }
+
+        last_frame_hash = hash;
+    }
+
+    /* The thumbnail taken before view was minimized, while it still is */
+    thumbnail_t *get_minimized_thumbnail(wayfire_view view)
+    {
+        auto toplevel = toplevel_cast(view);
+        return (toplevel && toplevel->minimized) ? thumbnail_cache.get(view->get_id()) : nullptr;
+    }
+
+    /* Scale the view's cached thumbnail over all of dst */
+    bool draw_thumbnail(const wf::render_buffer_t& dst)
+    {
+        auto thumbnail = thumbnail_cache.get(current_preview->get_id());
+        if (!thumbnail)
+        {
+            return false;
+        }
+
+        auto renderer = wf::get_core().renderer;
+        auto texture  = wlr_texture_from_pixels(renderer, DRM_FORMAT_ABGR8888, thumbnail->width * 4,
+            thumbnail->width, thumbnail->height, thumbnail->pixels.data());
+        if (!texture)
+        {
+            return false;
+        }
+
+        auto pass = wlr_renderer_begin_buffer_pass(renderer, dst.get_buffer(), nullptr);
+        if (!pass)
+        {
+            wlr_texture_destroy(texture);
+            return false;
+        }
+
+        auto size = dst.get_size();
+        wlr_render_texture_options options = {};
+        options.texture     = texture;
+        options.dst_box     = {0, 0, size.width, size.height};
+        options.filter_mode = WLR_SCALE_FILTER_BILINEAR;
+        options.blend_mode  = WLR_RENDER_BLEND_MODE_NONE;
+        wlr_render_pass_add_texture(pass, &options);
+        bool submitted = wlr_render_pass_submit(pass);
+        wlr_texture_destroy(texture);
+        return submitted;
+    }
+
+    void render_frame(const wf::render_buffer_t& dst)
+    {
+        /* The first frame of a minimized view's stream comes from the
+         * thumbnail taken before it was minimized, since the client may
+         * not draw again until it is restored */
+        if (serve_thumbnail)
+        {
+            serve_thumbnail = false;
+            if (draw_thumbnail(dst))
+            {
+                return;
+            }
+        }
+
+        /* Scroll detection lives in the cached path, so it goes first */
+        bool cached_first = detect_scrolling && cache_layers;
+        if (!(cached_first && render_cached(dst)) &&
+            !downscale_client_buffer(dst) &&
+            (!use_software_path() || !take_snapshot_software(dst)) &&
+            (cached_first || !render_cached(dst)))
+        {
+            wf::render_target_t target = wf::render_target_t(dst);
+            this->take_snapshot(&target);
+        }
+
+        update_frame_backoff(dst.get_buffer());
+    }
+
+    /* Render straight into a free swapchain buffer and pass it on, so the
+     * frame reaches the consumer without any copy. Returns false if the
+     * consumer holds every buffer, in which case the frame is retried on
+     * the next release. */
+    bool render_shm_frame()
+    {
+        if (!stream_client)
+        {
+            return true;
+        }
+
+        int64_t now_ms = monotonic_ns() / 1000000;
+        int timeout_ms = std::max(1, int(buffer_hold_timeout));
+        for (int reclaimed : swapchain->reclaim(now_ms, timeout_ms))
+        {
+            send_buffer_reclaimed(reclaimed);
+        }
+
+        int index = swapchain->acquire(current_size);
+        if (index < 0)
+        {
+            /* Retry once the oldest buffer can be reclaimed, in case the
+             * consumer never releases anything */
+            held_buffers_timer.disconnect();
+            held_buffers_timer.set_timeout(timeout_ms, [=] ()
+            {
+                render_flag = true;
+                schedule_preview_frame();
+            });
+            return false;
+        }
+
+        auto buffer = swapchain->get(index);
+        render_frame(wf::render_buffer_t{&buffer->base, current_size});
+        convert_for_export(&buffer->base);
+        swapchain->hold(index, now_ms);
+        send_frame_ready(index);
+        return true;
+    }
+
+    wf::post_hook_t post_hook = [=] (wf::auxilliary_buffer_t& src, const wf::render_buffer_t& dst)
+    {
+        if (drop_frame++ >= get_frame_skip())
+        {
+            drop_frame = 0;
+        } else
+        {
+            return;
+        }
+
+        if (!current_preview)
+        {
+            return;
+        }
+
+        if (!render_flag || throttle_low_power())
+        {
+            return;
+        }
+
+        render_flag = false;
+
+        int64_t start = monotonic_ns();
+        if (swapchain)
+        {
+            if (!render_shm_frame())
+            {
+                render_flag = true;
+                return;
+            }
+        } else
+        {
+            render_frame(dst);
+        }
+
+        last_frame_ns  = start;
+        render_time_ns = (render_time_ns * 7 + (monotonic_ns() - start)) / 8;
+    };
+
+    wf::signal::connection_t<wf::view_unmapped_signal> view_unmapped = [=] (wf::view_unmapped_signal *ev)
+    {
+        if (!current_preview || (ev->view != current_preview))
+        {
+            return;
+        }
+
+        send_stream_ended("unmapped");
+        set_stream_state(stream_state_t::SUSPENDED);
+    };
+
+    void destroy_output(std::string reason = "output-destroyed")
+    {
+        auto output = wf::get_core().output_layout->find_output("live-preview");
+        send_stream_ended(reason);
+        set_stream_state(stream_state_t::DESTROYED);
+        if (!output)
+        {
+            return;
         }
 
         wlr_output_layout_remove(wf::get_core().output_layout->get_handle(), output->handle);
@@ -346,8 +2648,33 @@ class live_previews_plugin : public wf::plugin_interface_t
     {
         method_repository->unregister_method("live_previews/request_stream");
         method_repository->unregister_method("live_previews/release_output");
+        method_repository->unregister_method("live_previews/set_power_mode");
+        method_repository->unregister_method("live_previews/snapshot");
+        method_repository->unregister_method("live_previews/workspace_snapshot");
+        method_repository->unregister_method("live_previews/release_buffer");
+        method_repository->unregister_method("live_previews/watch_activity");
         destroy_output();
         on_session_active.disconnect();
+        on_client_disconnected.disconnect();
+        on_layout_changed.disconnect();
+        on_output_added.disconnect();
+        on_output_pre_remove.disconnect();
+        on_minimize_request.disconnect();
+        on_view_unmapped.disconnect();
+        on_view_mapped.disconnect();
+        on_prewarm_geometry_changed.disconnect();
+        prewarm_timer.disconnect();
+        prewarm_due.clear();
+        thumbnail_cache.clear();
+        activity_timer.disconnect();
+        activity_watchers.clear();
+        view_activity.clear();
+        on_startup_finished.disconnect();
+        backend_idle.disconnect();
+        backend_destroy_timer.disconnect();
+        reconfigure_timer.disconnect();
+        snapshot_buffer.free();
+        workers.reset();
     }
 };
 }